@@ -1,10 +1,11 @@
-// Extract the document title by srching for a level-one header at the root level.
+// Extract the document title by searching for a level-one header at the root level.  Parsing
+// stops as soon as it's found, so the rest of the document is never read.
 
 extern crate comrak;
 
 use comrak::{
-    nodes::{AstNode, NodeCode, NodeValue},
-    parse_document, Arena, ComrakOptions,
+    nodes::{AstNode, NodeCode, NodeHeading, NodeValue},
+    parse_document_until, Arena, ComrakOptions,
 };
 
 fn main() {
@@ -15,16 +16,12 @@ fn main() {
 
 fn get_document_title(document: &str) -> String {
     let arena = Arena::new();
-    let root = parse_document(&arena, document, &ComrakOptions::default());
+    let mut title = None;
 
-    for node in root.children() {
-        let header = match node.data.clone().into_inner().value {
-            NodeValue::Heading(c) => c,
-            _ => continue,
-        };
-
-        if header.level != 1 {
-            continue;
+    parse_document_until(&arena, document, &ComrakOptions::default(), |node| {
+        match node.data.borrow().value {
+            NodeValue::Heading(NodeHeading { level: 1, .. }) => (),
+            _ => return false,
         }
 
         let mut text = Vec::new();
@@ -32,10 +29,11 @@ fn get_document_title(document: &str) -> String {
 
         // The input was already known good UTF-8 (document: &str) so comrak
         // guarantees the output will be too.
-        return String::from_utf8(text).unwrap();
-    }
+        title = Some(String::from_utf8(text).unwrap());
+        true
+    });
 
-    "Untitled Document".to_string()
+    title.unwrap_or_else(|| "Untitled Document".to_string())
 }
 
 fn collect_text<'a>(node: &'a AstNode<'a>, output: &mut Vec<u8>) {
@@ -22,59 +22,78 @@ use std::error::Error;
 use std::fs::File;
 use std::io::{self, BufWriter, Read, Write};
 
-fn iter_nodes<'a, W: Write>(
-    node: &'a AstNode<'a>,
-    writer: &mut W,
-    indent: usize,
-) -> io::Result<()> {
+fn iter_nodes<'a, W: Write>(node: &'a AstNode<'a>, writer: &mut W) -> io::Result<()> {
     use NodeValue::*;
 
     macro_rules! try_node_inline {
         ($node:expr, $name:ident) => {{
             if let $name(t) = $node {
-                return write!(
+                write!(
                     writer,
                     concat!(stringify!($name), "({:?})"),
                     String::from_utf8_lossy(&t)
-                );
+                )?;
+                continue;
             }
         }};
     }
 
-    match &node.data.borrow().value {
-        Text(t) => write!(writer, "{:?}", String::from_utf8_lossy(&t))?,
-        value => {
-            try_node_inline!(value, FootnoteDefinition);
-            try_node_inline!(value, FootnoteReference);
-            try_node_inline!(value, HtmlInline);
-
-            if let Code(code) = value {
-                return write!(
-                    writer,
-                    "Code({:?}, {})",
-                    String::from_utf8_lossy(&code.literal),
-                    code.num_backticks
-                );
-            }
+    enum Phase {
+        Pre,
+        Post,
+    }
 
-            let has_blocks = node.children().any(|c| c.data.borrow().value.block());
+    // Walk the tree with an explicit stack rather than recursing, so deeply
+    // nested input can't overflow the call stack. Each entry carries the
+    // node's indent and whether its siblings are laid out one per line.
+    let mut stack = vec![(node, 0, false, Phase::Pre)];
+
+    while let Some((node, indent, on_own_line, phase)) = stack.pop() {
+        let has_blocks = node.children().any(|c| c.data.borrow().value.block());
+
+        match phase {
+            Phase::Pre => {
+                if indent > 0 {
+                    if on_own_line {
+                        write!(writer, "\n{1:0$}", indent, " ")?;
+                    } else {
+                        write!(writer, " ")?;
+                    }
+                }
 
-            write!(writer, "({:?}", value)?;
-            for child in node.children() {
-                if has_blocks {
-                    write!(writer, "\n{1:0$}", indent + INDENT, " ")?;
-                } else {
-                    write!(writer, " ")?;
+                match &node.data.borrow().value {
+                    Text(t) => write!(writer, "{:?}", String::from_utf8_lossy(&t))?,
+                    value => {
+                        try_node_inline!(value, FootnoteDefinition);
+                        try_node_inline!(value, FootnoteReference);
+                        try_node_inline!(value, HtmlInline);
+
+                        if let Code(code) = value {
+                            write!(
+                                writer,
+                                "Code({:?}, {})",
+                                String::from_utf8_lossy(&code.literal),
+                                code.num_backticks
+                            )?;
+                            continue;
+                        }
+
+                        write!(writer, "({:?}", value)?;
+                        stack.push((node, indent, on_own_line, Phase::Post));
+                        for child in node.reverse_children() {
+                            stack.push((child, indent + INDENT, has_blocks, Phase::Pre));
+                        }
+                    }
                 }
-                iter_nodes(child, writer, indent + INDENT)?;
             }
-
-            if indent == 0 {
-                write!(writer, "\n)\n")?;
-            } else if CLOSE_NEWLINE && has_blocks {
-                write!(writer, "\n{1:0$})", indent, " ")?;
-            } else {
-                write!(writer, ")")?;
+            Phase::Post => {
+                if indent == 0 {
+                    write!(writer, "\n)\n")?;
+                } else if CLOSE_NEWLINE && has_blocks {
+                    write!(writer, "\n{1:0$})", indent, " ")?;
+                } else {
+                    write!(writer, ")")?;
+                }
             }
         }
     }
@@ -103,7 +122,7 @@ fn dump(source: &str) -> io::Result<()> {
     let doc = parse_document(&arena, source, &opts);
 
     let mut output = BufWriter::new(io::stdout());
-    iter_nodes(doc, &mut output, 0)
+    iter_nodes(doc, &mut output)
 }
 
 fn main() -> Result<(), Box<dyn Error>> {
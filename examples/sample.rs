@@ -12,7 +12,7 @@ fn small() {
 }
 
 fn large() {
-    use comrak::nodes::{AstNode, NodeValue};
+    use comrak::nodes::NodeValue;
     use comrak::{format_html, parse_document, Arena, ComrakOptions};
 
     // The returned nodes are created in the supplied Arena, and are bound by its lifetime.
@@ -24,17 +24,8 @@ fn large() {
         &ComrakOptions::default(),
     );
 
-    fn iter_nodes<'a, F>(node: &'a AstNode<'a>, f: &F)
-    where
-        F: Fn(&'a AstNode<'a>),
-    {
-        f(node);
-        for c in node.children() {
-            iter_nodes(c, f);
-        }
-    }
-
-    iter_nodes(root, &|node| {
+    // `descendants` walks the tree without recursing, so it's safe on arbitrarily deep input.
+    for node in root.descendants() {
         if let NodeValue::Text(ref mut text) = node.data.borrow_mut().value {
             let orig = std::mem::replace(text, vec![]);
             *text = String::from_utf8(orig)
@@ -43,7 +34,7 @@ fn large() {
                 .as_bytes()
                 .to_vec();
         }
-    });
+    }
 
     let mut html = vec![];
     format_html(root, &ComrakOptions::default(), &mut html).unwrap();
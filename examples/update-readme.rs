@@ -1,7 +1,7 @@
 // Update the "comrak --help" text in Comrak's own README.
 
 extern crate comrak;
-use comrak::nodes::{AstNode, NodeValue};
+use comrak::nodes::NodeValue;
 use comrak::{format_commonmark, parse_document, Arena, ComrakOptions};
 
 const HELP: &str = "$ comrak --help\n";
@@ -12,17 +12,7 @@ fn main() -> Result<(), Box<dyn std::error::Error + 'static>> {
     let readme = std::fs::read_to_string("README.md")?;
     let doc = parse_document(&arena, &readme, &ComrakOptions::default());
 
-    fn iter_nodes<'a, F>(node: &'a AstNode<'a>, f: &F)
-    where
-        F: Fn(&'a AstNode<'a>),
-    {
-        f(node);
-        for c in node.children() {
-            iter_nodes(c, f);
-        }
-    }
-
-    iter_nodes(doc, &|node| {
+    for node in doc.descendants() {
         // Look for a code block whose contents starts with the HELP string.
         // Replace its contents with the same string and the actual command output.
         if let NodeValue::CodeBlock(ref mut ncb) = node.data.borrow_mut().value {
@@ -33,7 +23,7 @@ fn main() -> Result<(), Box<dyn std::error::Error + 'static>> {
                 ncb.literal = content;
             }
         }
-    });
+    }
 
     let mut out = vec![];
     format_commonmark(doc, &ComrakOptions::default(), &mut out).unwrap();
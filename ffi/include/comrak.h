@@ -0,0 +1,90 @@
+/*
+ * A C API for Comrak, a CommonMark and GitHub Flavored Markdown parser and formatter.
+ *
+ * Create a context with the options you want, then render any number of documents with it.  Each
+ * render writes into a buffer you provide; if the output doesn't fit, the call returns
+ * COMRAK_BUFFER_TOO_SMALL with the length needed in *out_len, and comrak_copy_output copies the
+ * output into a larger buffer without rendering again.  Nothing returned by a render needs to be
+ * freed.
+ *
+ * A context must not be used by more than one thread at a time; give each thread its own.
+ *
+ * Input and string options must be UTF-8.  Lengths are in bytes, and strings needn't be
+ * NUL-terminated.
+ */
+
+#ifndef COMRAK_H
+#define COMRAK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Status codes. */
+#define COMRAK_OK 0
+/* The output didn't fit in the buffer given; it's kept in the context until the next render. */
+#define COMRAK_BUFFER_TOO_SMALL 1
+/* A null pointer was passed where one isn't allowed. */
+#define COMRAK_INVALID_ARGUMENT (-1)
+/* The input, or an option's value, wasn't valid UTF-8. */
+#define COMRAK_INVALID_UTF8 (-2)
+/* Comrak panicked while rendering.  The context can still be used. */
+#define COMRAK_INTERNAL_ERROR (-3)
+
+/* Flags for comrak_context_new. */
+#define COMRAK_EXT_STRIKETHROUGH (1u << 0)
+#define COMRAK_EXT_TAGFILTER (1u << 1)
+#define COMRAK_EXT_TABLE (1u << 2)
+#define COMRAK_EXT_AUTOLINK (1u << 3)
+#define COMRAK_EXT_TASKLIST (1u << 4)
+#define COMRAK_EXT_SUPERSCRIPT (1u << 5)
+#define COMRAK_EXT_FOOTNOTES (1u << 6)
+#define COMRAK_EXT_DESCRIPTION_LISTS (1u << 7)
+#define COMRAK_PARSE_SMART (1u << 8)
+#define COMRAK_RENDER_HARDBREAKS (1u << 9)
+#define COMRAK_RENDER_GITHUB_PRE_LANG (1u << 10)
+#define COMRAK_RENDER_UNSAFE (1u << 11)
+#define COMRAK_RENDER_ESCAPE (1u << 12)
+
+typedef struct comrak_context comrak_context;
+
+/* Creates a context with the options given by flags.  Free it with comrak_context_free. */
+comrak_context *comrak_context_new(uint32_t flags);
+
+/* Frees a context.  Does nothing if ctx is NULL. */
+void comrak_context_free(comrak_context *ctx);
+
+/* Sets the column at which CommonMark output is wrapped; 0, the default, doesn't wrap. */
+int comrak_context_set_width(comrak_context *ctx, size_t width);
+
+/* Enables the header IDs extension with the given ID prefix, or disables it if prefix is NULL. */
+int comrak_context_set_header_ids(comrak_context *ctx, const uint8_t *prefix, size_t len);
+
+/* Enables front matter with the given delimiter, or disables it if delimiter is NULL. */
+int comrak_context_set_front_matter_delimiter(comrak_context *ctx, const uint8_t *delimiter,
+                                              size_t len);
+
+/* Sets the info string given to fenced code blocks that have none, or unsets it if info is
+ * NULL. */
+int comrak_context_set_default_info_string(comrak_context *ctx, const uint8_t *info, size_t len);
+
+/* Renders md as HTML into out, storing the length of the output in *out_len. */
+int comrak_render_html(comrak_context *ctx, const uint8_t *md, size_t md_len, uint8_t *out,
+                       size_t out_cap, size_t *out_len);
+
+/* Renders md as CommonMark into out, storing the length of the output in *out_len. */
+int comrak_render_commonmark(comrak_context *ctx, const uint8_t *md, size_t md_len, uint8_t *out,
+                             size_t out_cap, size_t *out_len);
+
+/* Copies the output of the last render with ctx into out, storing its length in *out_len.  After a
+ * failed render the output is empty. */
+int comrak_copy_output(comrak_context *ctx, uint8_t *out, size_t out_cap, size_t *out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,395 @@
+//! A C API for [Comrak](https://github.com/kivikakk/comrak), built as a shared or static library.
+//!
+//! The interface is declared in `include/comrak.h`.  A caller creates a `comrak_context` holding
+//! the options it wants, then renders any number of documents with it.  Each render writes into a
+//! buffer the caller provides; if the output doesn't fit, the call says how big it is, and
+//! `comrak_copy_output` copies it into a larger buffer without rendering again.  The context keeps
+//! its output buffer between calls, so once it has grown to fit the largest document, rendering
+//! allocates nothing the caller has to free.
+//!
+//! A context must not be used by more than one thread at a time; give each thread its own.
+
+#![deny(missing_docs, missing_debug_implementations)]
+#![allow(non_camel_case_types)]
+
+extern crate comrak;
+
+use comrak::{format_commonmark, format_html, parse_document, Arena, ComrakOptions};
+use std::os::raw::c_int;
+use std::panic::{self, AssertUnwindSafe};
+use std::{ptr, slice, str};
+
+/// The call succeeded.
+pub const COMRAK_OK: c_int = 0;
+/// The output didn't fit in the buffer given; it's kept in the context until the next render.
+pub const COMRAK_BUFFER_TOO_SMALL: c_int = 1;
+/// A null pointer was passed where one isn't allowed.
+pub const COMRAK_INVALID_ARGUMENT: c_int = -1;
+/// The input, or an option's value, wasn't valid UTF-8.
+pub const COMRAK_INVALID_UTF8: c_int = -2;
+/// Comrak panicked while rendering.  The context can still be used.
+pub const COMRAK_INTERNAL_ERROR: c_int = -3;
+
+/// Enables the strikethrough extension.
+pub const COMRAK_EXT_STRIKETHROUGH: u32 = 1 << 0;
+/// Enables the tagfilter extension.
+pub const COMRAK_EXT_TAGFILTER: u32 = 1 << 1;
+/// Enables the table extension.
+pub const COMRAK_EXT_TABLE: u32 = 1 << 2;
+/// Enables the autolink extension.
+pub const COMRAK_EXT_AUTOLINK: u32 = 1 << 3;
+/// Enables the task list extension.
+pub const COMRAK_EXT_TASKLIST: u32 = 1 << 4;
+/// Enables the superscript extension.
+pub const COMRAK_EXT_SUPERSCRIPT: u32 = 1 << 5;
+/// Enables the footnotes extension.
+pub const COMRAK_EXT_FOOTNOTES: u32 = 1 << 6;
+/// Enables the description lists extension.
+pub const COMRAK_EXT_DESCRIPTION_LISTS: u32 = 1 << 7;
+/// Punctuates smartly, as with `ComrakParseOptions::smart`.
+pub const COMRAK_PARSE_SMART: u32 = 1 << 8;
+/// Renders soft line breaks as hard ones.
+pub const COMRAK_RENDER_HARDBREAKS: u32 = 1 << 9;
+/// Uses GitHub-style `<pre lang="...">` for fenced code blocks.
+pub const COMRAK_RENDER_GITHUB_PRE_LANG: u32 = 1 << 10;
+/// Renders raw HTML and dangerous URLs.
+pub const COMRAK_RENDER_UNSAFE: u32 = 1 << 11;
+/// Escapes raw HTML instead of omitting it.
+pub const COMRAK_RENDER_ESCAPE: u32 = 1 << 12;
+
+/// Options and an output buffer, reused across renders.
+#[derive(Debug)]
+pub struct comrak_context {
+    options: ComrakOptions,
+    output: Vec<u8>,
+}
+
+/// Creates a context with the options given by `flags`, a combination of the `COMRAK_EXT_*`,
+/// `COMRAK_PARSE_*` and `COMRAK_RENDER_*` constants.  Free it with `comrak_context_free`.
+#[no_mangle]
+pub extern "C" fn comrak_context_new(flags: u32) -> *mut comrak_context {
+    let mut options = ComrakOptions::default();
+    options.extension.strikethrough = flags & COMRAK_EXT_STRIKETHROUGH != 0;
+    options.extension.tagfilter = flags & COMRAK_EXT_TAGFILTER != 0;
+    options.extension.table = flags & COMRAK_EXT_TABLE != 0;
+    options.extension.autolink = flags & COMRAK_EXT_AUTOLINK != 0;
+    options.extension.tasklist = flags & COMRAK_EXT_TASKLIST != 0;
+    options.extension.superscript = flags & COMRAK_EXT_SUPERSCRIPT != 0;
+    options.extension.footnotes = flags & COMRAK_EXT_FOOTNOTES != 0;
+    options.extension.description_lists = flags & COMRAK_EXT_DESCRIPTION_LISTS != 0;
+    options.parse.smart = flags & COMRAK_PARSE_SMART != 0;
+    options.render.hardbreaks = flags & COMRAK_RENDER_HARDBREAKS != 0;
+    options.render.github_pre_lang = flags & COMRAK_RENDER_GITHUB_PRE_LANG != 0;
+    options.render.unsafe_ = flags & COMRAK_RENDER_UNSAFE != 0;
+    options.render.escape = flags & COMRAK_RENDER_ESCAPE != 0;
+
+    Box::into_raw(Box::new(comrak_context {
+        options,
+        output: vec![],
+    }))
+}
+
+/// Frees a context created by `comrak_context_new`.  Does nothing if `ctx` is null.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_context_free(ctx: *mut comrak_context) {
+    if !ctx.is_null() {
+        drop(Box::from_raw(ctx));
+    }
+}
+
+/// Sets the column at which CommonMark output is wrapped; 0, the default, doesn't wrap.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_context_set_width(ctx: *mut comrak_context, width: usize) -> c_int {
+    match ctx.as_mut() {
+        Some(ctx) => {
+            ctx.options.render.width = width;
+            COMRAK_OK
+        }
+        None => COMRAK_INVALID_ARGUMENT,
+    }
+}
+
+/// Enables the header IDs extension, prefixing each ID with the `len` bytes at `prefix`, or
+/// disables it if `prefix` is null.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_context_set_header_ids(
+    ctx: *mut comrak_context,
+    prefix: *const u8,
+    len: usize,
+) -> c_int {
+    set_string(ctx, prefix, len, |options| {
+        &mut options.extension.header_ids
+    })
+}
+
+/// Enables front matter, delimited by the `len` bytes at `delimiter`, or disables it if
+/// `delimiter` is null.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_context_set_front_matter_delimiter(
+    ctx: *mut comrak_context,
+    delimiter: *const u8,
+    len: usize,
+) -> c_int {
+    set_string(ctx, delimiter, len, |options| {
+        &mut options.extension.front_matter_delimiter
+    })
+}
+
+/// Sets the info string given to fenced code blocks that have none, or unsets it if `info` is
+/// null.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_context_set_default_info_string(
+    ctx: *mut comrak_context,
+    info: *const u8,
+    len: usize,
+) -> c_int {
+    set_string(ctx, info, len, |options| {
+        &mut options.parse.default_info_string
+    })
+}
+
+/// Renders the `md_len` bytes of Markdown at `md` as HTML into the `out_cap` bytes at `out`,
+/// storing the length of the output in `*out_len`.
+///
+/// Returns `COMRAK_BUFFER_TOO_SMALL` if the output is longer than `out_cap`, in which case
+/// nothing is written to `out`; `*out_len` still holds the length needed, and
+/// `comrak_copy_output` copies the output once a large enough buffer has been found.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_render_html(
+    ctx: *mut comrak_context,
+    md: *const u8,
+    md_len: usize,
+    out: *mut u8,
+    out_cap: usize,
+    out_len: *mut usize,
+) -> c_int {
+    render(ctx, md, md_len, out, out_cap, out_len, Format::Html)
+}
+
+/// Renders the `md_len` bytes of Markdown at `md` as CommonMark; otherwise as for
+/// `comrak_render_html`.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_render_commonmark(
+    ctx: *mut comrak_context,
+    md: *const u8,
+    md_len: usize,
+    out: *mut u8,
+    out_cap: usize,
+    out_len: *mut usize,
+) -> c_int {
+    render(ctx, md, md_len, out, out_cap, out_len, Format::CommonMark)
+}
+
+/// Copies the output of the last render with `ctx` into the `out_cap` bytes at `out`, storing its
+/// length in `*out_len`.  Returns `COMRAK_BUFFER_TOO_SMALL` if it still doesn't fit.  After a
+/// failed render the output is empty.
+#[no_mangle]
+pub unsafe extern "C" fn comrak_copy_output(
+    ctx: *mut comrak_context,
+    out: *mut u8,
+    out_cap: usize,
+    out_len: *mut usize,
+) -> c_int {
+    match ctx.as_ref() {
+        Some(ctx) if !out_len.is_null() => copy_output(&ctx.output, out, out_cap, out_len),
+        _ => COMRAK_INVALID_ARGUMENT,
+    }
+}
+
+enum Format {
+    Html,
+    CommonMark,
+}
+
+unsafe fn render(
+    ctx: *mut comrak_context,
+    md: *const u8,
+    md_len: usize,
+    out: *mut u8,
+    out_cap: usize,
+    out_len: *mut usize,
+    format: Format,
+) -> c_int {
+    let ctx = match ctx.as_mut() {
+        Some(ctx) => ctx,
+        None => return COMRAK_INVALID_ARGUMENT,
+    };
+    // Cleared before anything is validated, so a failed render never leaves
+    // the previous document behind for comrak_copy_output.
+    ctx.output.clear();
+    if out_len.is_null() {
+        return COMRAK_INVALID_ARGUMENT;
+    }
+    let md = match bytes(md, md_len).map(str::from_utf8) {
+        Some(Ok(md)) => md,
+        Some(Err(_)) => return COMRAK_INVALID_UTF8,
+        None => return COMRAK_INVALID_ARGUMENT,
+    };
+
+    let options = &ctx.options;
+    let output = &mut ctx.output;
+    // Unwinding into C is undefined behaviour, so a panic is caught here and
+    // reported as an error.
+    let rendered = panic::catch_unwind(AssertUnwindSafe(|| {
+        let arena = Arena::new();
+        let root = parse_document(&arena, md, options);
+        match format {
+            Format::Html => format_html(root, options, output),
+            Format::CommonMark => format_commonmark(root, options, output),
+        }
+    }));
+    match rendered {
+        Ok(Ok(())) => copy_output(&ctx.output, out, out_cap, out_len),
+        _ => {
+            ctx.output.clear();
+            COMRAK_INTERNAL_ERROR
+        }
+    }
+}
+
+unsafe fn copy_output(output: &[u8], out: *mut u8, out_cap: usize, out_len: *mut usize) -> c_int {
+    *out_len = output.len();
+    if output.len() > out_cap {
+        return COMRAK_BUFFER_TOO_SMALL;
+    }
+    if !output.is_empty() {
+        if out.is_null() {
+            return COMRAK_INVALID_ARGUMENT;
+        }
+        ptr::copy_nonoverlapping(output.as_ptr(), out, output.len());
+    }
+    COMRAK_OK
+}
+
+unsafe fn set_string<F>(ctx: *mut comrak_context, value: *const u8, len: usize, field: F) -> c_int
+where
+    F: FnOnce(&mut ComrakOptions) -> &mut Option<String>,
+{
+    let ctx = match ctx.as_mut() {
+        Some(ctx) => ctx,
+        None => return COMRAK_INVALID_ARGUMENT,
+    };
+    let value = if value.is_null() {
+        None
+    } else {
+        match str::from_utf8(slice::from_raw_parts(value, len)) {
+            Ok(value) => Some(value.to_string()),
+            Err(_) => return COMRAK_INVALID_UTF8,
+        }
+    };
+    *field(&mut ctx.options) = value;
+    COMRAK_OK
+}
+
+// The `len` bytes at `data`, which may be null only if `len` is 0.
+unsafe fn bytes<'a>(data: *const u8, len: usize) -> Option<&'a [u8]> {
+    if len == 0 {
+        Some(&[])
+    } else if data.is_null() {
+        None
+    } else {
+        Some(slice::from_raw_parts(data, len))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn render_to_string(
+        ctx: *mut comrak_context,
+        md: &str,
+        cap: usize,
+        format: Format,
+    ) -> (c_int, usize, Vec<u8>) {
+        let mut out = vec![0; cap];
+        let mut len = 0;
+        let status = unsafe {
+            render(
+                ctx,
+                md.as_ptr(),
+                md.len(),
+                out.as_mut_ptr(),
+                cap,
+                &mut len,
+                format,
+            )
+        };
+        out.truncate(len.min(cap));
+        (status, len, out)
+    }
+
+    #[test]
+    fn render_into_buffers() {
+        let ctx = comrak_context_new(COMRAK_EXT_TABLE | COMRAK_EXT_STRIKETHROUGH);
+        let md = "~~a~~ *b*\n\n|x|\n|-|\n";
+        let html = "<p><del>a</del> <em>b</em></p>\n\
+                    <table>\n<thead>\n<tr>\n<th>x</th>\n</tr>\n</thead>\n</table>\n";
+
+        assert_eq!(
+            render_to_string(ctx, md, 1024, Format::Html),
+            (COMRAK_OK, html.len(), html.as_bytes().to_vec())
+        );
+
+        let (status, len, _) = render_to_string(ctx, md, 8, Format::Html);
+        assert_eq!((status, len), (COMRAK_BUFFER_TOO_SMALL, html.len()));
+        let mut out = vec![0; len];
+        let mut copied = 0;
+        let status = unsafe { comrak_copy_output(ctx, out.as_mut_ptr(), len, &mut copied) };
+        assert_eq!((status, copied), (COMRAK_OK, len));
+        assert_eq!(out, html.as_bytes());
+
+        unsafe {
+            assert_eq!(comrak_context_set_width(ctx, 10), COMRAK_OK);
+        }
+        let cm = "one two\nthree four\n";
+        assert_eq!(
+            render_to_string(ctx, "one two three four\n", 1024, Format::CommonMark),
+            (COMRAK_OK, cm.len(), cm.as_bytes().to_vec())
+        );
+
+        unsafe { comrak_context_free(ctx) };
+    }
+
+    #[test]
+    fn options_and_errors() {
+        let ctx = comrak_context_new(0);
+        let prefix = "h-";
+        unsafe {
+            assert_eq!(
+                comrak_context_set_header_ids(ctx, prefix.as_ptr(), prefix.len()),
+                COMRAK_OK
+            );
+            assert_eq!(
+                comrak_context_set_default_info_string(ctx, b"\xff".as_ptr(), 1),
+                COMRAK_INVALID_UTF8
+            );
+            assert_eq!(
+                comrak_context_set_width(ptr::null_mut(), 0),
+                COMRAK_INVALID_ARGUMENT
+            );
+        }
+        let html =
+            "<h1><a href=\"#a\" aria-hidden=\"true\" class=\"anchor\" id=\"h-a\"></a>A</h1>\n";
+        assert_eq!(
+            render_to_string(ctx, "# A\n", 1024, Format::Html),
+            (COMRAK_OK, html.len(), html.as_bytes().to_vec())
+        );
+
+        let mut len = 0;
+        let status =
+            unsafe { comrak_render_html(ctx, b"\xff".as_ptr(), 1, ptr::null_mut(), 0, &mut len) };
+        assert_eq!(status, COMRAK_INVALID_UTF8);
+        let status = unsafe { comrak_copy_output(ctx, ptr::null_mut(), 0, &mut len) };
+        assert_eq!((status, len), (COMRAK_OK, 0));
+        let status =
+            unsafe { comrak_render_html(ctx, ptr::null(), 0, ptr::null_mut(), 0, &mut len) };
+        assert_eq!((status, len), (COMRAK_OK, 0));
+
+        unsafe {
+            comrak_context_set_header_ids(ctx, ptr::null(), 0);
+            comrak_context_free(ctx);
+            comrak_context_free(ptr::null_mut());
+        }
+    }
+}
@@ -0,0 +1,208 @@
+//! Adapter traits for plugins.
+//!
+//! Each plugin has to implement one of the traits available in this module.
+
+use rustc_hash::{FxHashMap, FxHasher};
+use std::collections::VecDeque;
+use std::fmt;
+use std::hash::{Hash, Hasher};
+use std::io::{self, Write};
+use std::sync::{Arc, Mutex, MutexGuard};
+
+/// Implement this adapter to highlight the contents of code blocks as they're rendered to HTML.
+///
+/// The formatter still writes the `<pre>` and `<code>` tags around each block as usual; the
+/// adapter writes what goes between them, in place of the escaped code.
+///
+/// ```
+/// # use comrak::{markdown_to_html_with_plugins, ComrakOptions, ComrakPlugins};
+/// # use comrak::adapters::SyntaxHighlighterAdapter;
+/// # use std::io::{self, Write};
+/// struct Shouty;
+///
+/// impl SyntaxHighlighterAdapter for Shouty {
+///     fn highlight(&self, output: &mut dyn Write, info: &str, code: &str) -> io::Result<bool> {
+///         if info != "shout" {
+///             return Ok(false);
+///         }
+///         write!(output, "<b>{}</b>", code.trim_end().to_uppercase())?;
+///         Ok(true)
+///     }
+/// }
+///
+/// let mut plugins = ComrakPlugins::default();
+/// plugins.render.codefence_syntax_highlighter = Some(&Shouty);
+///
+/// assert_eq!(
+///     markdown_to_html_with_plugins("```shout\nhi\n```\n\n    <quiet>\n", &ComrakOptions::default(), &plugins),
+///     "<pre><code class=\"language-shout\"><b>HI</b></code></pre>\n\
+///      <pre><code>&lt;quiet&gt;\n</code></pre>\n"
+/// );
+/// ```
+pub trait SyntaxHighlighterAdapter {
+    /// Writes the highlighted HTML for `code`, the literal contents of a code block whose info
+    /// string is `info` (empty for an indented code block), and returns `true`.  Returning
+    /// `false` without writing anything leaves the block to be rendered as usual.
+    fn highlight(&self, output: &mut dyn Write, info: &str, code: &str) -> io::Result<bool>;
+}
+
+/// Wraps a [`SyntaxHighlighterAdapter`](trait.SyntaxHighlighterAdapter.html), remembering what it
+/// wrote for each distinct info string and code, so that a snippet that recurs across documents
+/// is highlighted once.  Once `capacity` snippets are held, the oldest is forgotten to make room.
+///
+/// Snippets are keyed by a hash of the info string and code, and the cache may be shared between
+/// threads.
+///
+/// ```
+/// # use comrak::{markdown_to_html_with_plugins, ComrakOptions, ComrakPlugins};
+/// # use comrak::adapters::{CachedSyntaxHighlighter, SyntaxHighlighterAdapter};
+/// # use std::io::{self, Write};
+/// # use std::sync::atomic::{AtomicUsize, Ordering};
+/// struct Counting(AtomicUsize);
+///
+/// impl SyntaxHighlighterAdapter for Counting {
+///     fn highlight(&self, output: &mut dyn Write, _info: &str, code: &str) -> io::Result<bool> {
+///         self.0.fetch_add(1, Ordering::SeqCst);
+///         write!(output, "<i>{}</i>", code.trim_end())?;
+///         Ok(true)
+///     }
+/// }
+///
+/// let cache = CachedSyntaxHighlighter::new(Counting(AtomicUsize::new(0)), 100);
+/// let mut plugins = ComrakPlugins::default();
+/// plugins.render.codefence_syntax_highlighter = Some(&cache);
+///
+/// for _ in 0..3 {
+///     markdown_to_html_with_plugins("```rust\nfn main() {}\n```\n", &ComrakOptions::default(), &plugins);
+/// }
+/// assert_eq!(cache.len(), 1);
+/// assert_eq!(cache.adapter().0.load(Ordering::SeqCst), 1);
+/// ```
+pub struct CachedSyntaxHighlighter<A> {
+    adapter: A,
+    capacity: usize,
+    snippets: Mutex<Snippets>,
+}
+
+#[derive(Default)]
+struct Snippets {
+    entries: FxHashMap<u64, Snippet>,
+    order: VecDeque<u64>,
+}
+
+struct Snippet {
+    info: String,
+    code: String,
+    // What the adapter wrote, or `None` if it declined the block.
+    html: Option<Arc<[u8]>>,
+}
+
+impl<A> CachedSyntaxHighlighter<A>
+where
+    A: SyntaxHighlighterAdapter,
+{
+    /// Wraps `adapter`, remembering its output for up to `capacity` snippets.
+    pub fn new(adapter: A, capacity: usize) -> Self {
+        CachedSyntaxHighlighter {
+            adapter,
+            capacity,
+            snippets: Mutex::new(Snippets::default()),
+        }
+    }
+
+    /// The wrapped adapter.
+    pub fn adapter(&self) -> &A {
+        &self.adapter
+    }
+
+    /// The number of snippets currently remembered.
+    pub fn len(&self) -> usize {
+        self.lock().entries.len()
+    }
+
+    /// Whether no snippets are currently remembered.
+    pub fn is_empty(&self) -> bool {
+        self.lock().entries.is_empty()
+    }
+
+    /// Forgets all remembered snippets.
+    pub fn clear(&self) {
+        let mut snippets = self.lock();
+        snippets.entries.clear();
+        snippets.order.clear();
+    }
+
+    // A panic in another thread while the lock was held can't have left the
+    // cache inconsistent, so a poisoned lock is used as is.
+    fn lock(&self) -> MutexGuard<'_, Snippets> {
+        self.snippets.lock().unwrap_or_else(|e| e.into_inner())
+    }
+}
+
+impl<A> SyntaxHighlighterAdapter for CachedSyntaxHighlighter<A>
+where
+    A: SyntaxHighlighterAdapter,
+{
+    fn highlight(&self, output: &mut dyn Write, info: &str, code: &str) -> io::Result<bool> {
+        let mut hasher = FxHasher::default();
+        info.hash(&mut hasher);
+        code.hash(&mut hasher);
+        let key = hasher.finish();
+
+        let cached = match self.lock().entries.get(&key) {
+            Some(snippet) if snippet.info == info && snippet.code == code => {
+                Some(snippet.html.clone())
+            }
+            _ => None,
+        };
+        let html = match cached {
+            Some(html) => html,
+            None => {
+                // Highlight without holding the lock, so that other threads
+                // aren't held up.
+                let mut buffer = vec![];
+                let html = if self.adapter.highlight(&mut buffer, info, code)? {
+                    Some(Arc::from(buffer))
+                } else {
+                    None
+                };
+                if self.capacity > 0 {
+                    let mut snippets = self.lock();
+                    if !snippets.entries.contains_key(&key) {
+                        if snippets.entries.len() >= self.capacity {
+                            if let Some(oldest) = snippets.order.pop_front() {
+                                snippets.entries.remove(&oldest);
+                            }
+                        }
+                        snippets.order.push_back(key);
+                    }
+                    snippets.entries.insert(
+                        key,
+                        Snippet {
+                            info: info.to_string(),
+                            code: code.to_string(),
+                            html: html.clone(),
+                        },
+                    );
+                }
+                html
+            }
+        };
+
+        match html {
+            Some(html) => {
+                output.write_all(&html)?;
+                Ok(true)
+            }
+            None => Ok(false),
+        }
+    }
+}
+
+impl<A> fmt::Debug for CachedSyntaxHighlighter<A> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("CachedSyntaxHighlighter")
+            .field("capacity", &self.capacity)
+            .finish()
+    }
+}
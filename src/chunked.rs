@@ -0,0 +1,85 @@
+//! Writing formatted output to a Tokio `AsyncWrite` a chunk at a time.
+
+use std::cell::RefCell;
+use std::io::{self, Write};
+use std::pin::Pin;
+use std::task::{Context, Poll};
+use tokio::io::AsyncWrite;
+
+/// How much output a formatter produces before pausing to write it out.  A formatter only pauses
+/// between nodes, so a chunk can run over by the output of a single node.
+pub const CHUNK_SIZE: usize = 16 * 1024;
+
+/// Holds the output formatted so far and writes it to `output` as it becomes writable.
+pub struct ChunkedOutput<'w, W: ?Sized + 'w> {
+    output: &'w mut W,
+    pub buffer: RefCell<Vec<u8>>,
+    written: usize,
+}
+
+impl<'w, W> ChunkedOutput<'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    pub fn new(output: &'w mut W) -> Self {
+        ChunkedOutput {
+            output,
+            buffer: RefCell::new(Vec::with_capacity(CHUNK_SIZE)),
+            written: 0,
+        }
+    }
+
+    /// Whether a whole chunk is waiting to be written.
+    pub fn is_full(&self) -> bool {
+        self.buffer.borrow().len() >= CHUNK_SIZE
+    }
+
+    /// Writes out the buffer.  Once a chunk has been written the task yields to the executor
+    /// before completing, so that formatting a long document doesn't starve its other tasks.
+    pub fn poll_drain(&mut self, cx: &mut Context) -> Poll<io::Result<()>> {
+        let buffer = self.buffer.get_mut();
+        if buffer.is_empty() {
+            return Poll::Ready(Ok(()));
+        }
+        while self.written < buffer.len() {
+            match Pin::new(&mut *self.output).poll_write(cx, &buffer[self.written..]) {
+                Poll::Ready(Ok(0)) => {
+                    return Poll::Ready(Err(io::Error::new(
+                        io::ErrorKind::WriteZero,
+                        "failed to write whole buffer",
+                    )))
+                }
+                Poll::Ready(Ok(n)) => self.written += n,
+                Poll::Ready(Err(e)) => return Poll::Ready(Err(e)),
+                Poll::Pending => return Poll::Pending,
+            }
+        }
+        buffer.clear();
+        self.written = 0;
+        cx.waker().wake_by_ref();
+        Poll::Pending
+    }
+
+    /// Writes out the rest of the buffer and flushes `output`.
+    pub fn poll_finish(&mut self, cx: &mut Context) -> Poll<io::Result<()>> {
+        match self.poll_drain(cx) {
+            Poll::Ready(Ok(())) => Pin::new(&mut *self.output).poll_flush(cx),
+            other => other,
+        }
+    }
+}
+
+/// A `Write` into a `ChunkedOutput`'s buffer, which leaves the buffer free to be measured while
+/// it's being written to.
+pub struct BufferWriter<'b>(pub &'b RefCell<Vec<u8>>);
+
+impl<'b> Write for BufferWriter<'b> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.0.borrow_mut().extend_from_slice(buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
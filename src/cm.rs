@@ -1,5 +1,6 @@
+#[cfg(feature = "tokio")]
+use chunked::{ChunkedOutput, CHUNK_SIZE};
 use ctype::{isalpha, isdigit, ispunct, isspace};
-use nodes;
 use nodes::TableAlignment;
 use nodes::{
     AstNode, ListDelimType, ListType, NodeCodeBlock, NodeHeading, NodeHtmlBlock, NodeLink,
@@ -9,7 +10,19 @@ use parser::ComrakOptions;
 use scanners;
 use std;
 use std::cmp::max;
+#[cfg(feature = "tokio")]
+use std::cmp::min;
+#[cfg(feature = "tokio")]
+use std::fmt;
+#[cfg(feature = "tokio")]
+use std::future::Future;
 use std::io::{self, Write};
+#[cfg(feature = "tokio")]
+use std::pin::Pin;
+#[cfg(feature = "tokio")]
+use std::task::{Context, Poll};
+#[cfg(feature = "tokio")]
+use tokio::io::AsyncWrite;
 
 /// Formats an AST as CommonMark, modified by the given options.
 pub fn format_document<'a>(
@@ -26,8 +39,92 @@ pub fn format_document<'a>(
     Ok(())
 }
 
+/// Formats an AST as CommonMark to a Tokio `AsyncWrite`, modified by the given options.
+///
+/// Like `format_html_async`, the returned future writes the document a chunk at a time, yielding
+/// to the executor between chunks, and isn't `Send`.  The output is the same as that of
+/// `format_commonmark`.
+#[cfg(feature = "tokio")]
+pub fn format_document_async<'a, 'o, 'w, W>(
+    root: &'a AstNode<'a>,
+    options: &'o ComrakOptions,
+    output: &'w mut W,
+) -> FormatCommonMark<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    FormatCommonMark {
+        f: CommonMarkFormatter::new(root, options),
+        stack: vec![(root, Phase::Pre)],
+        finished: false,
+        output: ChunkedOutput::new(output),
+    }
+}
+
+/// The future returned by `format_commonmark_async`.
+#[cfg(feature = "tokio")]
+pub struct FormatCommonMark<'a, 'o, 'w, W: ?Sized + 'w> {
+    f: CommonMarkFormatter<'a, 'o>,
+    stack: Vec<Step<'a>>,
+    finished: bool,
+    output: ChunkedOutput<'w, W>,
+}
+
+#[cfg(feature = "tokio")]
+impl<'a, 'o, 'w, W> Future for FormatCommonMark<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    type Output = io::Result<()>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context) -> Poll<io::Result<()>> {
+        let this = &mut *self;
+        loop {
+            if this.finished {
+                return this.output.poll_finish(cx);
+            }
+            match this.output.poll_drain(cx) {
+                Poll::Ready(Ok(())) => (),
+                other => return other,
+            }
+
+            this.f.format_steps(&mut this.stack, CHUNK_SIZE);
+            let buffer = this.output.buffer.get_mut();
+            if this.stack.is_empty() {
+                if !this.f.v.is_empty() && this.f.v[this.f.v.len() - 1] != b'\n' {
+                    this.f.v.push(b'\n');
+                }
+                buffer.append(&mut this.f.v);
+                this.finished = true;
+            } else {
+                this.f.take_output(buffer);
+            }
+        }
+    }
+}
+
+#[cfg(feature = "tokio")]
+impl<'a, 'o, 'w, W: ?Sized> fmt::Debug for FormatCommonMark<'a, 'o, 'w, W> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("FormatCommonMark")
+            .field("finished", &self.finished)
+            .finish()
+    }
+}
+
+enum Phase {
+    Pre,
+    Post,
+}
+
+// A node still to be formatted, and whether it's being entered or exited.
+type Step<'a> = (&'a AstNode<'a>, Phase);
+
 struct CommonMarkFormatter<'a, 'o> {
     node: &'a AstNode<'a>,
+    // The block most recently entered or exited. Inlines only occur in leaf
+    // blocks, so for an inline node this is its containing block.
+    block: &'a AstNode<'a>,
     options: &'o ComrakOptions,
     v: Vec<u8>,
     prefix: Vec<u8>,
@@ -65,6 +162,7 @@ impl<'a, 'o> CommonMarkFormatter<'a, 'o> {
     fn new(node: &'a AstNode<'a>, options: &'o ComrakOptions) -> Self {
         CommonMarkFormatter {
             node,
+            block: node,
             options,
             v: vec![],
             prefix: vec![],
@@ -234,12 +332,14 @@ impl<'a, 'o> CommonMarkFormatter<'a, 'o> {
     }
 
     fn format(&mut self, node: &'a AstNode<'a>) {
-        enum Phase {
-            Pre,
-            Post,
-        }
         let mut stack = vec![(node, Phase::Pre)];
+        self.format_steps(&mut stack, usize::MAX);
+    }
 
+    // Formats the nodes on `stack` until it's empty, or until at least `limit`
+    // bytes of output are held after a node, in which case formatting can be
+    // resumed by calling this again with the same stack.
+    fn format_steps(&mut self, stack: &mut Vec<Step<'a>>, limit: usize) {
         while let Some((node, phase)) = stack.pop() {
             match phase {
                 Phase::Pre => {
@@ -254,14 +354,35 @@ impl<'a, 'o> CommonMarkFormatter<'a, 'o> {
                     self.format_node(node, false);
                 }
             }
+
+            if self.v.len() >= limit {
+                break;
+            }
         }
     }
 
-    fn get_in_tight_list_item(&self, node: &'a AstNode<'a>) -> bool {
-        let tmp = match nodes::containing_block(node) {
-            Some(tmp) => tmp,
-            None => return false,
-        };
+    // Moves the output formatted so far to `output`, except for what's still
+    // to be looked back at: the last two bytes, which are checked for the
+    // newlines owed by `need_cr`, and, when wrapping, everything from the last
+    // place a line could be broken.
+    #[cfg(feature = "tokio")]
+    fn take_output(&mut self, output: &mut Vec<u8>) {
+        let mut taken = self.v.len().saturating_sub(2);
+        if self.options.render.width > 0 && self.last_breakable > 0 {
+            // Keep a byte before the break so that it stays nonzero.
+            taken = min(taken, self.last_breakable - 1);
+            self.last_breakable -= taken;
+        }
+        output.extend(self.v.drain(..taken));
+    }
+
+    fn get_in_tight_list_item(&mut self, node: &'a AstNode<'a>) -> bool {
+        // Track the containing block as we go rather than walking up from
+        // every node, which is quadratic in the depth of nested inlines.
+        if node.data.borrow().value.block() {
+            self.block = node;
+        }
+        let tmp = self.block;
 
         if let NodeValue::Item(..) = tmp.data.borrow().value {
             if let NodeValue::List(ref nl) = tmp.parent().unwrap().data.borrow().value {
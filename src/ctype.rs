@@ -1,3 +1,5 @@
+use std::cmp::Ordering;
+
 #[rustfmt::skip]
 const CMARK_CTYPE_CLASS: [u8; 256] = [
     /*      0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
@@ -38,3 +40,194 @@ pub fn isalpha(ch: u8) -> bool {
 pub fn isalnum(ch: u8) -> bool {
     CMARK_CTYPE_CLASS[ch as usize] == 3 || CMARK_CTYPE_CLASS[ch as usize] == 4
 }
+
+// Whether a character next to a delimiter run counts as whitespace (1) or
+// punctuation (2) when deciding if the run is left- or right-flanking, for
+// each character below U+0100.  This follows `char::is_whitespace` and the
+// Unicode punctuation categories, so unlike `ispunct`, symbols such as `$`
+// and `~` don't count.
+#[rustfmt::skip]
+const FLANKING_CLASS: [u8; 256] = [
+    /*      0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
+    /* 0 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,
+    /* 1 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 2 */ 1, 2, 2, 2, 0, 2, 2, 2, 2, 2, 2, 0, 2, 2, 2, 2,
+    /* 3 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 0, 0, 0, 2,
+    /* 4 */ 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 5 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 0, 2,
+    /* 6 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 7 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 2, 0, 0,
+    /* 8 */ 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 9 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* a */ 1, 2, 0, 0, 0, 0, 0, 2, 0, 0, 0, 2, 0, 0, 0, 0,
+    /* b */ 0, 0, 0, 0, 0, 0, 2, 2, 0, 0, 0, 2, 0, 0, 0, 2,
+    /* c */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* d */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* e */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* f */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+];
+
+// Every code point in one of the Unicode punctuation categories (Pc, Pd, Ps,
+// Pe, Pi, Pf and Po), as of Unicode 14.0.0, in sorted, inclusive ranges.
+// `flanking` only searches these beyond the Basic Multilingual Plane; its
+// other tables are derived from them.
+#[rustfmt::skip]
+const PUNCTUATION_RANGES: [(u32, u32); 189] = [
+    (0x0021, 0x0023), (0x0025, 0x002a), (0x002c, 0x002f), (0x003a, 0x003b), (0x003f, 0x0040),
+    (0x005b, 0x005d), (0x005f, 0x005f), (0x007b, 0x007b), (0x007d, 0x007d), (0x00a1, 0x00a1),
+    (0x00a7, 0x00a7), (0x00ab, 0x00ab), (0x00b6, 0x00b7), (0x00bb, 0x00bb), (0x00bf, 0x00bf),
+    (0x037e, 0x037e), (0x0387, 0x0387), (0x055a, 0x055f), (0x0589, 0x058a), (0x05be, 0x05be),
+    (0x05c0, 0x05c0), (0x05c3, 0x05c3), (0x05c6, 0x05c6), (0x05f3, 0x05f4), (0x0609, 0x060a),
+    (0x060c, 0x060d), (0x061b, 0x061b), (0x061d, 0x061f), (0x066a, 0x066d), (0x06d4, 0x06d4),
+    (0x0700, 0x070d), (0x07f7, 0x07f9), (0x0830, 0x083e), (0x085e, 0x085e), (0x0964, 0x0965),
+    (0x0970, 0x0970), (0x09fd, 0x09fd), (0x0a76, 0x0a76), (0x0af0, 0x0af0), (0x0c77, 0x0c77),
+    (0x0c84, 0x0c84), (0x0df4, 0x0df4), (0x0e4f, 0x0e4f), (0x0e5a, 0x0e5b), (0x0f04, 0x0f12),
+    (0x0f14, 0x0f14), (0x0f3a, 0x0f3d), (0x0f85, 0x0f85), (0x0fd0, 0x0fd4), (0x0fd9, 0x0fda),
+    (0x104a, 0x104f), (0x10fb, 0x10fb), (0x1360, 0x1368), (0x1400, 0x1400), (0x166e, 0x166e),
+    (0x169b, 0x169c), (0x16eb, 0x16ed), (0x1735, 0x1736), (0x17d4, 0x17d6), (0x17d8, 0x17da),
+    (0x1800, 0x180a), (0x1944, 0x1945), (0x1a1e, 0x1a1f), (0x1aa0, 0x1aa6), (0x1aa8, 0x1aad),
+    (0x1b5a, 0x1b60), (0x1b7d, 0x1b7e), (0x1bfc, 0x1bff), (0x1c3b, 0x1c3f), (0x1c7e, 0x1c7f),
+    (0x1cc0, 0x1cc7), (0x1cd3, 0x1cd3), (0x2010, 0x2027), (0x2030, 0x2043), (0x2045, 0x2051),
+    (0x2053, 0x205e), (0x207d, 0x207e), (0x208d, 0x208e), (0x2308, 0x230b), (0x2329, 0x232a),
+    (0x2768, 0x2775), (0x27c5, 0x27c6), (0x27e6, 0x27ef), (0x2983, 0x2998), (0x29d8, 0x29db),
+    (0x29fc, 0x29fd), (0x2cf9, 0x2cfc), (0x2cfe, 0x2cff), (0x2d70, 0x2d70), (0x2e00, 0x2e2e),
+    (0x2e30, 0x2e4f), (0x2e52, 0x2e5d), (0x3001, 0x3003), (0x3008, 0x3011), (0x3014, 0x301f),
+    (0x3030, 0x3030), (0x303d, 0x303d), (0x30a0, 0x30a0), (0x30fb, 0x30fb), (0xa4fe, 0xa4ff),
+    (0xa60d, 0xa60f), (0xa673, 0xa673), (0xa67e, 0xa67e), (0xa6f2, 0xa6f7), (0xa874, 0xa877),
+    (0xa8ce, 0xa8cf), (0xa8f8, 0xa8fa), (0xa8fc, 0xa8fc), (0xa92e, 0xa92f), (0xa95f, 0xa95f),
+    (0xa9c1, 0xa9cd), (0xa9de, 0xa9df), (0xaa5c, 0xaa5f), (0xaade, 0xaadf), (0xaaf0, 0xaaf1),
+    (0xabeb, 0xabeb), (0xfd3e, 0xfd3f), (0xfe10, 0xfe19), (0xfe30, 0xfe52), (0xfe54, 0xfe61),
+    (0xfe63, 0xfe63), (0xfe68, 0xfe68), (0xfe6a, 0xfe6b), (0xff01, 0xff03), (0xff05, 0xff0a),
+    (0xff0c, 0xff0f), (0xff1a, 0xff1b), (0xff1f, 0xff20), (0xff3b, 0xff3d), (0xff3f, 0xff3f),
+    (0xff5b, 0xff5b), (0xff5d, 0xff5d), (0xff5f, 0xff65), (0x10100, 0x10102), (0x1039f, 0x1039f),
+    (0x103d0, 0x103d0), (0x1056f, 0x1056f), (0x10857, 0x10857), (0x1091f, 0x1091f),
+    (0x1093f, 0x1093f), (0x10a50, 0x10a58), (0x10a7f, 0x10a7f), (0x10af0, 0x10af6),
+    (0x10b39, 0x10b3f), (0x10b99, 0x10b9c), (0x10ead, 0x10ead), (0x10f55, 0x10f59),
+    (0x10f86, 0x10f89), (0x11047, 0x1104d), (0x110bb, 0x110bc), (0x110be, 0x110c1),
+    (0x11140, 0x11143), (0x11174, 0x11175), (0x111c5, 0x111c8), (0x111cd, 0x111cd),
+    (0x111db, 0x111db), (0x111dd, 0x111df), (0x11238, 0x1123d), (0x112a9, 0x112a9),
+    (0x1144b, 0x1144f), (0x1145a, 0x1145b), (0x1145d, 0x1145d), (0x114c6, 0x114c6),
+    (0x115c1, 0x115d7), (0x11641, 0x11643), (0x11660, 0x1166c), (0x116b9, 0x116b9),
+    (0x1173c, 0x1173e), (0x1183b, 0x1183b), (0x11944, 0x11946), (0x119e2, 0x119e2),
+    (0x11a3f, 0x11a46), (0x11a9a, 0x11a9c), (0x11a9e, 0x11aa2), (0x11c41, 0x11c45),
+    (0x11c70, 0x11c71), (0x11ef7, 0x11ef8), (0x11fff, 0x11fff), (0x12470, 0x12474),
+    (0x12ff1, 0x12ff2), (0x16a6e, 0x16a6f), (0x16af5, 0x16af5), (0x16b37, 0x16b3b),
+    (0x16b44, 0x16b44), (0x16e97, 0x16e9a), (0x16fe2, 0x16fe2), (0x1bc9f, 0x1bc9f),
+    (0x1da87, 0x1da8b), (0x1e95e, 0x1e95f),
+];
+
+/// Whether `ch` is Unicode punctuation, by a search of `PUNCTUATION_RANGES`.
+pub fn is_punctuation(ch: char) -> bool {
+    let c = ch as u32;
+    PUNCTUATION_RANGES
+        .binary_search_by(|&(lo, hi)| {
+            if hi < c {
+                Ordering::Less
+            } else if lo > c {
+                Ordering::Greater
+            } else {
+                Ordering::Equal
+            }
+        })
+        .is_ok()
+}
+
+// The same punctuation within the Basic Multilingual Plane as a bitmap: the
+// bitmap for each block of 256 code points is PUNCTUATION_BLOCKS[i], where i
+// is the block's entry in PUNCTUATION_BLOCK_INDEX.
+#[rustfmt::skip]
+const PUNCTUATION_BLOCK_INDEX: [u8; 256] = [
+    0, 1, 1, 2, 1, 3, 4, 5, 6, 7, 8, 1, 9, 10, 11, 12,
+    13, 1, 1, 14, 15, 1, 16, 17, 18, 19, 20, 21, 22, 1, 1, 1,
+    23, 1, 1, 24, 1, 1, 1, 25, 1, 26, 1, 1, 27, 28, 29, 1,
+    30, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 31, 1, 32, 1, 33, 34, 35, 36, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 37, 38, 39,
+];
+
+#[rustfmt::skip]
+const PUNCTUATION_BLOCKS: [[u64; 4]; 40] = [
+    [0x8c00f7ee00000000, 0x28000000b8000001, 0x88c0088200000000, 0x0000000000000000],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000000, 0x4000000000000000, 0x0000000000000080, 0x0000000000000000],
+    [0x0000000000000000, 0x00000000fc000000, 0x4000000000000600, 0x0018000000000049],
+    [0x00000000e8003600, 0x00003c0000000000, 0x0000000000000000, 0x0000000000100000],
+    [0x0000000000003fff, 0x0000000000000000, 0x0000000000000000, 0x0380000000000000],
+    [0x7fff000000000000, 0x0000000040000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000000, 0x0001003000000000, 0x0000000000000000, 0x2000000000000000],
+    [0x0000000000000000, 0x0040000000000000, 0x0000000000000000, 0x0001000000000000],
+    [0x0000000000000000, 0x0080000000000000, 0x0000000000000010, 0x0000000000000000],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0x0010000000000000],
+    [0x0000000000000000, 0x000000000c008000, 0x0000000000000000, 0x0000000000000000],
+    [0x3c0000000017fff0, 0x0000000000000000, 0x0000000000000020, 0x00000000061f0000],
+    [0x0000000000000000, 0x000000000000fc00, 0x0000000000000000, 0x0800000000000000],
+    [0x0000000000000000, 0x000001ff00000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000001, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000000, 0x0000400000000000, 0x0000000018000000, 0x0000380000000000],
+    [0x0060000000000000, 0x0000000000000000, 0x0000000000000000, 0x0000000007700000],
+    [0x00000000000007ff, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000000, 0x0000000000000030, 0x0000000000000000, 0x0000000000000000],
+    [0x00000000c0000000, 0x0000000000000000, 0x00003f7f00000000, 0x0000000000000000],
+    [0x0000000000000000, 0x60000001fc000000, 0x0000000000000000, 0xf000000000000000],
+    [0xf800000000000000, 0xc000000000000000, 0x0000000000000000, 0x00000000000800ff],
+    [0xffff00ffffff0000, 0x600000007ffbffef, 0x0000000000006000, 0x0000000000000000],
+    [0x0000060000000f00, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0x0000000000000000, 0x003fff0000000000, 0x0000000000000000, 0x0000ffc000000060],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000001fffff8, 0x300000000f000000],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0xde00000000000000],
+    [0x0000000000000000, 0x0001000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0xffff7fffffffffff, 0x000000003ffcffff, 0x0000000000000000, 0x0000000000000000],
+    [0x20010000fff3ff0e, 0x0000000000000000, 0x0000000100000000, 0x0800000000000000],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0xc000000000000000],
+    [0x000000000000e000, 0x4008000000000000, 0x0000000000000000, 0x00fc000000000000],
+    [0x0000000000000000, 0x00f0000000000000, 0x0000000000000000, 0x170000000000c000],
+    [0x0000c00000000000, 0x0000000080000000, 0x0000000000000000, 0x00000000c0003ffe],
+    [0x0000000000000000, 0x00000000f0000000, 0x0000000000000000, 0x00030000c0000000],
+    [0x0000000000000000, 0x0000000000000000, 0x0000000000000000, 0x0000080000000000],
+    [0xc000000000000000, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000],
+    [0xffff000003ff0000, 0x00000d0bfff7ffff, 0x0000000000000000, 0x0000000000000000],
+    [0xb80000018c00f7ee, 0x0000003fa8000000, 0x0000000000000000, 0x0000000000000000],
+];
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum Flanking {
+    Whitespace,
+    Punctuation,
+    Other,
+}
+
+pub fn flanking(ch: char) -> Flanking {
+    let c = ch as u32;
+    if c < 0x100 {
+        return match FLANKING_CLASS[c as usize] {
+            1 => Flanking::Whitespace,
+            2 => Flanking::Punctuation,
+            _ => Flanking::Other,
+        };
+    }
+
+    let punctuation = if c < 0x10000 {
+        let block = &PUNCTUATION_BLOCKS[PUNCTUATION_BLOCK_INDEX[(c >> 8) as usize] as usize];
+        block[((c >> 6) & 3) as usize] & (1 << (c & 63)) != 0
+    } else {
+        is_punctuation(ch)
+    };
+
+    if punctuation {
+        Flanking::Punctuation
+    } else if ch.is_whitespace() {
+        Flanking::Whitespace
+    } else {
+        Flanking::Other
+    }
+}
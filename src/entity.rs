@@ -1,5 +1,6 @@
 use ctype::isdigit;
 use entities::ENTITIES;
+use std::borrow::Cow;
 use std::char;
 use std::cmp::min;
 use std::str;
@@ -78,38 +79,31 @@ fn lookup(text: &[u8]) -> Option<&[u8]> {
     }
 }
 
-pub fn unescape_html(src: &[u8]) -> Vec<u8> {
+// Decodes entity references in `src`, borrowing it unchanged when there are
+// none.
+pub fn unescape_html(src: &[u8]) -> Cow<'_, [u8]> {
     let size = src.len();
     let mut i = 0;
-    let mut v = Vec::with_capacity(size);
-
-    while i < size {
-        let org = i;
-        while i < size && src[i] != b'&' {
-            i += 1;
-        }
-
-        if i > org {
-            if org == 0 && i >= size {
-                return src.to_vec();
-            }
-
-            v.extend_from_slice(&src[org..i]);
-        }
-
-        if i >= size {
-            return v;
-        }
-
-        i += 1;
-        match unescape(&src[i..]) {
-            Some((chs, size)) => {
-                v.extend_from_slice(&chs);
-                i += size;
+    let mut copied = 0;
+    let mut v = Vec::new();
+
+    while let Some(amp) = src[i..].iter().position(|&c| c == b'&') {
+        i += amp + 1;
+        if let Some((chs, len)) = unescape(&src[i..]) {
+            if copied == 0 {
+                v.reserve(size);
             }
-            None => v.push(b'&'),
+            v.extend_from_slice(&src[copied..i - 1]);
+            v.extend_from_slice(&chs);
+            i += len;
+            copied = i;
         }
     }
 
-    v
+    if copied == 0 {
+        Cow::Borrowed(src)
+    } else {
+        v.extend_from_slice(&src[copied..]);
+        Cow::Owned(v)
+    }
 }
@@ -1,25 +1,49 @@
+#[cfg(feature = "tokio")]
+use chunked::{BufferWriter, ChunkedOutput};
 use ctype::isspace;
 use nodes::{AstNode, ListType, NodeCode, NodeValue, TableAlignment};
-use parser::ComrakOptions;
+use parser::{self, ComrakOptions, ComrakPlugins, StreamSink};
 use regex::Regex;
-use scanners;
 use std::borrow::Cow;
 use std::cell::Cell;
 use std::collections::HashSet;
+#[cfg(feature = "tokio")]
+use std::fmt;
+#[cfg(feature = "tokio")]
+use std::future::Future;
 use std::io::{self, Write};
+#[cfg(feature = "tokio")]
+use std::mem;
+#[cfg(feature = "tokio")]
+use std::pin::Pin;
 use std::str;
+#[cfg(feature = "tokio")]
+use std::task::{Context, Poll};
+#[cfg(feature = "tokio")]
+use tokio::io::AsyncWrite;
+use typed_arena::Arena;
 
 /// Formats an AST as HTML, modified by the given options.
 pub fn format_document<'a>(
     root: &'a AstNode<'a>,
     options: &ComrakOptions,
     output: &mut dyn Write,
+) -> io::Result<()> {
+    format_document_with_plugins(root, options, output, &ComrakPlugins::default())
+}
+
+/// Formats an AST as HTML, modified by the given options. Accepts custom plugins.
+pub fn format_document_with_plugins<'a>(
+    root: &'a AstNode<'a>,
+    options: &ComrakOptions,
+    output: &mut dyn Write,
+    plugins: &ComrakPlugins,
 ) -> io::Result<()> {
     let mut writer = WriteWithLast {
         output,
         last_was_lf: Cell::new(true),
     };
-    let mut f = HtmlFormatter::new(options, &mut writer);
+    let mut f = HtmlFormatter::new(options, &mut writer, plugins);
     f.format(root, false)?;
     if f.footnote_ix > 0 {
         f.output.write_all(b"</ol>\n</section>\n")?;
@@ -27,6 +51,225 @@ pub fn format_document<'a>(
     Ok(())
 }
 
+/// Parses `buffer` and formats it as HTML, writing each top-level block as soon as it's parsed.
+/// Each body row of a top-level table is written and dropped as soon as it's parsed, rather than
+/// being held until the table is complete.
+pub fn stream_document(
+    buffer: &str,
+    options: &ComrakOptions,
+    output: &mut dyn Write,
+) -> io::Result<()> {
+    let arena = Arena::new();
+    let mut writer = WriteWithLast {
+        output,
+        last_was_lf: Cell::new(true),
+    };
+    let plugins = ComrakPlugins::default();
+    let mut sink = HtmlStreamSink {
+        f: HtmlFormatter::new(options, &mut writer, &plugins),
+        in_body: false,
+    };
+    parser::parse_streaming(&arena, buffer, options, &mut sink)?;
+    if sink.f.footnote_ix > 0 {
+        sink.f.output.write_all(b"</ol>\n</section>\n")?;
+    }
+    Ok(())
+}
+
+/// Formats an AST as HTML to a Tokio `AsyncWrite`, modified by the given options.
+///
+/// The returned future formats the document a chunk of a few kilobytes at a time, writing out
+/// each chunk and yielding to the executor before formatting the next, so that a long document
+/// neither holds up the executor's other tasks nor has to be buffered in full.  The output is the
+/// same as that of `format_html`.
+///
+/// Nodes in the AST aren't `Sync`, so the future isn't `Send`; on a multi-threaded runtime, run it
+/// with `block_on`, or spawn it on a `LocalSet`.
+///
+/// ```edition2018
+/// use comrak::{format_html_async, parse_document, Arena, ComrakOptions};
+/// use tokio::io::AsyncWrite;
+///
+/// async fn render<W: AsyncWrite + Unpin>(markdown: &str, output: &mut W) -> std::io::Result<()> {
+///     let arena = Arena::new();
+///     let options = ComrakOptions::default();
+///     let root = parse_document(&arena, markdown, &options);
+///     format_html_async(root, &options, output).await
+/// }
+/// ```
+#[cfg(feature = "tokio")]
+pub fn format_document_async<'a, 'o, 'w, W>(
+    root: &'a AstNode<'a>,
+    options: &'o ComrakOptions,
+    output: &'w mut W,
+) -> FormatHtml<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    FormatHtml::new(root, options, None, output)
+}
+
+/// Formats an AST as HTML to a Tokio `AsyncWrite`, modified by the given options. Accepts custom
+/// plugins.  See `format_html_async`.
+#[cfg(feature = "tokio")]
+pub fn format_document_with_plugins_async<'a, 'o, 'w, W>(
+    root: &'a AstNode<'a>,
+    options: &'o ComrakOptions,
+    output: &'w mut W,
+    plugins: &'o ComrakPlugins<'o>,
+) -> FormatHtml<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    FormatHtml::new(root, options, Some(plugins), output)
+}
+
+/// The future returned by `format_html_async` and `format_html_with_plugins_async`.
+#[cfg(feature = "tokio")]
+pub struct FormatHtml<'a, 'o, 'w, W: ?Sized + 'w> {
+    options: &'o ComrakOptions,
+    plugins: Option<&'o ComrakPlugins<'o>>,
+    stack: Vec<Step<'a>>,
+    // The formatter's state, carried between chunks.
+    anchorizer: Anchorizer,
+    footnote_ix: u32,
+    written_footnote_ix: u32,
+    last_was_lf: bool,
+    finished: bool,
+    output: ChunkedOutput<'w, W>,
+}
+
+#[cfg(feature = "tokio")]
+impl<'a, 'o, 'w, W> FormatHtml<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    fn new(
+        root: &'a AstNode<'a>,
+        options: &'o ComrakOptions,
+        plugins: Option<&'o ComrakPlugins<'o>>,
+        output: &'w mut W,
+    ) -> Self {
+        FormatHtml {
+            options,
+            plugins,
+            stack: vec![(root, false, Phase::Pre)],
+            anchorizer: Anchorizer::new(),
+            footnote_ix: 0,
+            written_footnote_ix: 0,
+            last_was_lf: true,
+            finished: false,
+            output: ChunkedOutput::new(output),
+        }
+    }
+
+    fn format_chunk(&mut self) -> io::Result<()> {
+        let default_plugins;
+        let plugins = match self.plugins {
+            Some(plugins) => plugins,
+            None => {
+                default_plugins = ComrakPlugins::default();
+                &default_plugins
+            }
+        };
+        let output = &self.output;
+        let mut buffer = BufferWriter(&output.buffer);
+        let mut writer = WriteWithLast {
+            output: &mut buffer,
+            last_was_lf: Cell::new(self.last_was_lf),
+        };
+        let mut f = HtmlFormatter::new(self.options, &mut writer, plugins);
+        f.anchorizer = mem::replace(&mut self.anchorizer, Anchorizer::new());
+        f.footnote_ix = self.footnote_ix;
+        f.written_footnote_ix = self.written_footnote_ix;
+
+        let result = f.format_steps(&mut self.stack, || output.is_full());
+        if result.is_ok() && self.stack.is_empty() {
+            if f.footnote_ix > 0 {
+                f.output.write_all(b"</ol>\n</section>\n")?;
+            }
+            self.finished = true;
+        }
+
+        self.last_was_lf = f.output.last_was_lf.get();
+        self.anchorizer = f.anchorizer;
+        self.footnote_ix = f.footnote_ix;
+        self.written_footnote_ix = f.written_footnote_ix;
+        result
+    }
+}
+
+#[cfg(feature = "tokio")]
+impl<'a, 'o, 'w, W> Future for FormatHtml<'a, 'o, 'w, W>
+where
+    W: AsyncWrite + Unpin + ?Sized,
+{
+    type Output = io::Result<()>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context) -> Poll<io::Result<()>> {
+        let this = &mut *self;
+        loop {
+            if this.finished {
+                return this.output.poll_finish(cx);
+            }
+            match this.output.poll_drain(cx) {
+                Poll::Ready(Ok(())) => (),
+                other => return other,
+            }
+            if let Err(e) = this.format_chunk() {
+                return Poll::Ready(Err(e));
+            }
+        }
+    }
+}
+
+#[cfg(feature = "tokio")]
+impl<'a, 'o, 'w, W: ?Sized> fmt::Debug for FormatHtml<'a, 'o, 'w, W> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("FormatHtml")
+            .field("finished", &self.finished)
+            .finish()
+    }
+}
+
+struct HtmlStreamSink<'o> {
+    f: HtmlFormatter<'o>,
+    in_body: bool,
+}
+
+impl<'a, 'o> StreamSink<'a> for HtmlStreamSink<'o> {
+    fn block(&mut self, node: &'a AstNode<'a>) -> io::Result<()> {
+        self.f.format(node, false)
+    }
+
+    fn table_start(&mut self, table: &'a AstNode<'a>) -> io::Result<()> {
+        self.in_body = false;
+        self.f.format_node(table, true)?;
+        for row in table.children() {
+            self.f.format(row, false)?;
+        }
+        Ok(())
+    }
+
+    fn table_row<'b>(&mut self, row: &'b AstNode<'b>) -> io::Result<()> {
+        if !self.in_body {
+            self.f.cr()?;
+            self.f.output.write_all(b"<tbody>\n")?;
+            self.in_body = true;
+        }
+        self.f.format(row, false)
+    }
+
+    fn table_end(&mut self, _table: &'a AstNode<'a>) -> io::Result<()> {
+        if self.in_body {
+            self.f.cr()?;
+            self.f.output.write_all(b"</tbody>\n")?;
+        }
+        self.f.cr()?;
+        self.f.output.write_all(b"</table>\n")
+    }
+}
+
 pub struct WriteWithLast<'w> {
     output: &'w mut dyn Write,
     pub last_was_lf: Cell<bool>,
@@ -116,9 +359,19 @@ impl Anchorizer {
     }
 }
 
+enum Phase {
+    Pre,
+    Post,
+}
+
+// A node still to be formatted, whether it's to be formatted as plain text,
+// and whether its opening or closing tag is next.
+type Step<'a> = (&'a AstNode<'a>, bool, Phase);
+
 struct HtmlFormatter<'o> {
     output: &'o mut WriteWithLast<'o>,
     options: &'o ComrakOptions,
+    plugins: &'o ComrakPlugins<'o>,
     anchorizer: Anchorizer,
     footnote_ix: u32,
     written_footnote_ix: u32,
@@ -229,15 +482,132 @@ fn tagfilter_block(input: &[u8], o: &mut dyn Write) -> io::Result<()> {
     Ok(())
 }
 
-fn dangerous_url(input: &[u8]) -> bool {
-    scanners::dangerous_url(input).is_some()
+/// Decides which URL schemes links, images and sanitized HTML may use, on top of the
+/// built-in rules that always apply: `javascript:`, `vbscript:`, `file:` and `data:` URLs
+/// (other than PNG, GIF, JPEG and WebP images) are dangerous.  URLs without a scheme, such
+/// as relative paths and fragments, are never dangerous.
+///
+/// Dangerous URLs are left out of the output, unless
+/// [`ComrakRenderOptions::unsafe_`](struct.ComrakRenderOptions.html#structfield.unsafe_) is
+/// set.
+///
+/// ```
+/// # use comrak::{markdown_to_html_with_plugins, ComrakOptions, ComrakPlugins, UrlSchemeFilter};
+/// let mut filter = UrlSchemeFilter::new();
+/// filter.allow_only(&["https", "mailto"]);
+///
+/// let mut plugins = ComrakPlugins::default();
+/// plugins.render.url_scheme_filter = Some(&filter);
+///
+/// assert_eq!(
+///     markdown_to_html_with_plugins(
+///         "[a](https://example.com) [b](ftp://example.com) [c](#top)\n",
+///         &ComrakOptions::default(),
+///         &plugins
+///     ),
+///     "<p><a href=\"https://example.com\">a</a> <a href=\"\">b</a> <a href=\"#top\">c</a></p>\n"
+/// );
+/// ```
+#[derive(Debug, Clone, Default)]
+pub struct UrlSchemeFilter {
+    allowed: Option<Vec<Vec<u8>>>,
+    denied: Vec<Vec<u8>>,
+}
+
+impl UrlSchemeFilter {
+    /// A filter that applies only the built-in rules.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Treats URLs with a scheme as dangerous unless it's one of `schemes`, replacing any
+    /// previous list.  The built-in rules still apply to the schemes listed.
+    pub fn allow_only(&mut self, schemes: &[&str]) {
+        self.allowed = Some(
+            schemes
+                .iter()
+                .map(|s| s.as_bytes().to_ascii_lowercase())
+                .collect(),
+        );
+    }
+
+    /// Treats URLs with any of `schemes` as dangerous, in addition to those already denied.
+    pub fn deny(&mut self, schemes: &[&str]) {
+        self.denied
+            .extend(schemes.iter().map(|s| s.as_bytes().to_ascii_lowercase()));
+    }
+
+    /// Whether `url` would be left out of the output.
+    pub fn is_dangerous(&self, url: &[u8]) -> bool {
+        let scheme = match url_scheme(url) {
+            Some(scheme) => scheme,
+            None => return false,
+        };
+        dangerous_scheme(scheme, &url[scheme.len() + 1..])
+            || self.denied.iter().any(|s| scheme.eq_ignore_ascii_case(s))
+            || match self.allowed {
+                Some(ref allowed) => !allowed.iter().any(|s| scheme.eq_ignore_ascii_case(s)),
+                None => false,
+            }
+    }
+}
+
+const DANGEROUS_SCHEMES: [&[u8]; 3] = [b"javascript", b"vbscript", b"file"];
+const SAFE_DATA_TYPES: [&[u8]; 4] = [b"image/png", b"image/gif", b"image/jpeg", b"image/webp"];
+
+pub fn dangerous_url(input: &[u8]) -> bool {
+    match url_scheme(input) {
+        Some(scheme) => dangerous_scheme(scheme, &input[scheme.len() + 1..]),
+        None => false,
+    }
+}
+
+// The scheme `url` starts with, without the colon: a letter followed by
+// letters, digits, `+`, `-` or `.`.
+fn url_scheme(url: &[u8]) -> Option<&[u8]> {
+    if !url.first().map_or(false, u8::is_ascii_alphabetic) {
+        return None;
+    }
+    for (i, &c) in url.iter().enumerate().skip(1) {
+        match c {
+            b':' => return Some(&url[..i]),
+            b'+' | b'-' | b'.' => (),
+            _ if c.is_ascii_alphanumeric() => (),
+            _ => return None,
+        }
+    }
+    None
+}
+
+fn dangerous_scheme(scheme: &[u8], rest: &[u8]) -> bool {
+    if scheme.eq_ignore_ascii_case(b"data") {
+        !SAFE_DATA_TYPES
+            .iter()
+            .any(|t| rest.len() >= t.len() && rest[..t.len()].eq_ignore_ascii_case(t))
+    } else {
+        DANGEROUS_SCHEMES
+            .iter()
+            .any(|s| scheme.eq_ignore_ascii_case(s))
+    }
 }
 
 impl<'o> HtmlFormatter<'o> {
-    fn new(options: &'o ComrakOptions, output: &'o mut WriteWithLast<'o>) -> Self {
+    fn dangerous_url(&self, url: &[u8]) -> bool {
+        match self.plugins.render.url_scheme_filter {
+            Some(filter) => filter.is_dangerous(url),
+            None => dangerous_url(url),
+        }
+    }
+
+    fn new(
+        options: &'o ComrakOptions,
+        output: &'o mut WriteWithLast<'o>,
+        plugins: &'o ComrakPlugins,
+    ) -> Self {
         HtmlFormatter {
             options,
             output,
+            plugins,
             anchorizer: Anchorizer::new(),
             footnote_ix: 0,
             written_footnote_ix: 0,
@@ -319,18 +689,23 @@ impl<'o> HtmlFormatter<'o> {
     }
 
     fn format<'a>(&mut self, node: &'a AstNode<'a>, plain: bool) -> io::Result<()> {
+        let mut stack = vec![(node, plain, Phase::Pre)];
+        self.format_steps(&mut stack, || false)
+    }
+
+    // Formats the nodes on `stack` until it's empty, or until `pause` returns
+    // true after a node, in which case formatting can be resumed by calling
+    // this again with the same stack.
+    fn format_steps<'a, P>(&mut self, stack: &mut Vec<Step<'a>>, pause: P) -> io::Result<()>
+    where
+        P: Fn() -> bool,
+    {
         // Traverse the AST iteratively using a work stack, with pre- and
         // post-child-traversal phases. During pre-order traversal render the
         // opening tags, then push the node back onto the stack for the
         // post-order traversal phase, then push the children in reverse order
         // onto the stack and begin rendering first child.
 
-        enum Phase {
-            Pre,
-            Post,
-        }
-        let mut stack = vec![(node, plain, Phase::Pre)];
-
         while let Some((node, plain, phase)) = stack.pop() {
             match phase {
                 Phase::Pre => {
@@ -362,20 +737,28 @@ impl<'o> HtmlFormatter<'o> {
                     self.format_node(node, false)?;
                 }
             }
+
+            if pause() {
+                break;
+            }
         }
 
         Ok(())
     }
 
     fn collect_text<'a>(&self, node: &'a AstNode<'a>, output: &mut Vec<u8>) {
-        match node.data.borrow().value {
-            NodeValue::Text(ref literal) | NodeValue::Code(NodeCode { ref literal, .. }) => {
-                output.extend_from_slice(literal)
-            }
-            NodeValue::LineBreak | NodeValue::SoftBreak => output.push(b' '),
-            _ => {
-                for n in node.children() {
-                    self.collect_text(n, output);
+        let mut stack = vec![node];
+
+        while let Some(node) = stack.pop() {
+            match node.data.borrow().value {
+                NodeValue::Text(ref literal) | NodeValue::Code(NodeCode { ref literal, .. }) => {
+                    output.extend_from_slice(literal)
+                }
+                NodeValue::LineBreak | NodeValue::SoftBreak => output.push(b' '),
+                _ => {
+                    for n in node.reverse_children() {
+                        stack.push(n);
+                    }
                 }
             }
         }
@@ -486,7 +869,17 @@ impl<'o> HtmlFormatter<'o> {
                             self.output.write_all(b"\">")?;
                         }
                     }
-                    self.escape(&ncb.literal)?;
+                    let highlighted = match self.plugins.render.codefence_syntax_highlighter {
+                        Some(highlighter) => highlighter.highlight(
+                            self.output,
+                            str::from_utf8(&ncb.info).unwrap(),
+                            str::from_utf8(&ncb.literal).unwrap(),
+                        )?,
+                        None => false,
+                    };
+                    if !highlighted {
+                        self.escape(&ncb.literal)?;
+                    }
                     self.output.write_all(b"</code></pre>\n")?;
                 }
             }
@@ -495,6 +888,12 @@ impl<'o> HtmlFormatter<'o> {
                     self.cr()?;
                     if self.options.render.escape {
                         self.escape(&nhb.literal)?;
+                    } else if let Some(sanitizer) = self.plugins.render.html_sanitizer {
+                        sanitizer.sanitize(
+                            &nhb.literal,
+                            self.plugins.render.url_scheme_filter,
+                            self.output,
+                        )?;
                     } else if !self.options.render.unsafe_ {
                         self.output.write_all(b"<!-- raw HTML omitted -->")?;
                     } else if self.options.extension.tagfilter {
@@ -574,6 +973,12 @@ impl<'o> HtmlFormatter<'o> {
                 if entering {
                     if self.options.render.escape {
                         self.escape(&literal)?;
+                    } else if let Some(sanitizer) = self.plugins.render.html_sanitizer {
+                        sanitizer.sanitize(
+                            literal,
+                            self.plugins.render.url_scheme_filter,
+                            self.output,
+                        )?;
                     } else if !self.options.render.unsafe_ {
                         self.output.write_all(b"<!-- raw HTML omitted -->")?;
                     } else if self.options.extension.tagfilter && tagfilter(literal) {
@@ -615,7 +1020,7 @@ impl<'o> HtmlFormatter<'o> {
             NodeValue::Link(ref nl) => {
                 if entering {
                     self.output.write_all(b"<a href=\"")?;
-                    if self.options.render.unsafe_ || !dangerous_url(&nl.url) {
+                    if self.options.render.unsafe_ || !self.dangerous_url(&nl.url) {
                         self.escape_href(&nl.url)?;
                     }
                     if !nl.title.is_empty() {
@@ -630,7 +1035,7 @@ impl<'o> HtmlFormatter<'o> {
             NodeValue::Image(ref nl) => {
                 if entering {
                     self.output.write_all(b"<img src=\"")?;
-                    if self.options.render.unsafe_ || !dangerous_url(&nl.url) {
+                    if self.options.render.unsafe_ || !self.dangerous_url(&nl.url) {
                         self.escape_href(&nl.url)?;
                     }
                     self.output.write_all(b"\" alt=\"")?;
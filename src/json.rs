@@ -0,0 +1,253 @@
+use nodes::{AstNode, ListDelimType, ListType, NodeValue, TableAlignment};
+use parser::ComrakOptions;
+use std::io::{self, Write};
+use std::{slice, str};
+
+/// Formats an AST as JSON.
+///
+/// Each node is written as an object with its `type`, the fields of its value, and its
+/// `children`.  Block nodes also have the `start_line` they begin on; inlines don't keep track of
+/// theirs.  Byte strings are written as JSON strings, with any invalid UTF-8 replaced
+/// by U+FFFD.  The whole document is written on one line, followed by a newline.
+///
+/// ```
+/// # use comrak::{format_json, parse_document, Arena, ComrakOptions};
+/// let arena = Arena::new();
+/// let root = parse_document(&arena, "*Hi*\n", &ComrakOptions::default());
+/// let mut json = vec![];
+/// format_json(root, &ComrakOptions::default(), &mut json).unwrap();
+/// assert_eq!(
+///     String::from_utf8(json).unwrap(),
+///     "{\"type\":\"document\",\"start_line\":0,\"children\":[\
+///      {\"type\":\"paragraph\",\"start_line\":1,\"children\":[\
+///      {\"type\":\"emph\",\"children\":[\
+///      {\"type\":\"text\",\"literal\":\"Hi\",\"children\":[]}]}]}]}\n"
+/// );
+/// ```
+pub fn format_document<'a>(
+    root: &'a AstNode<'a>,
+    _options: &ComrakOptions,
+    output: &mut dyn Write,
+) -> io::Result<()> {
+    enum Phase {
+        Pre,
+        Post,
+    }
+    // Each entry also says whether the node follows a sibling, and so needs a
+    // comma before it.
+    let mut stack = vec![(root, false, Phase::Pre)];
+
+    while let Some((node, follows, phase)) = stack.pop() {
+        match phase {
+            Phase::Pre => {
+                if follows {
+                    output.write_all(b",")?;
+                }
+                format_node(node, output)?;
+                output.write_all(b",\"children\":[")?;
+                stack.push((node, false, Phase::Post));
+                for ch in node.reverse_children() {
+                    stack.push((ch, ch.previous_sibling().is_some(), Phase::Pre));
+                }
+            }
+            Phase::Post => {
+                output.write_all(b"]}")?;
+            }
+        }
+    }
+
+    output.write_all(b"\n")
+}
+
+// Writes the opening of a node's object, up to but not including its
+// children.
+fn format_node<'a>(node: &'a AstNode<'a>, output: &mut dyn Write) -> io::Result<()> {
+    let ast = node.data.borrow();
+    output.write_all(b"{\"type\":\"")?;
+    output.write_all(node_type(&ast.value))?;
+    output.write_all(b"\"")?;
+    if ast.value.block() {
+        write!(output, ",\"start_line\":{}", ast.start_line)?;
+    }
+
+    match ast.value {
+        NodeValue::FrontMatter(ref literal)
+        | NodeValue::Text(ref literal)
+        | NodeValue::HtmlInline(ref literal) => {
+            write_field(output, "literal", literal)?;
+        }
+        NodeValue::List(ref nl) | NodeValue::Item(ref nl) => {
+            let list_type = match nl.list_type {
+                ListType::Bullet => "bullet",
+                ListType::Ordered => "ordered",
+            };
+            let delimiter = match nl.delimiter {
+                ListDelimType::Period => "period",
+                ListDelimType::Paren => "paren",
+            };
+            write!(
+                output,
+                ",\"list_type\":\"{}\",\"start\":{},\"delimiter\":\"{}\"",
+                list_type, nl.start, delimiter
+            )?;
+            write_field(output, "bullet_char", marker(&nl.bullet_char))?;
+            write!(output, ",\"tight\":{}", nl.tight)?;
+        }
+        NodeValue::CodeBlock(ref ncb) => {
+            write!(output, ",\"fenced\":{}", ncb.fenced)?;
+            write_field(output, "fence_char", marker(&ncb.fence_char))?;
+            write!(output, ",\"fence_length\":{}", ncb.fence_length)?;
+            write_field(output, "info", &ncb.info)?;
+            write_field(output, "literal", &ncb.literal)?;
+        }
+        NodeValue::HtmlBlock(ref nhb) => {
+            write_field(output, "literal", &nhb.literal)?;
+        }
+        NodeValue::Heading(ref nh) => {
+            write!(output, ",\"level\":{},\"setext\":{}", nh.level, nh.setext)?;
+        }
+        NodeValue::FootnoteDefinition(ref name) | NodeValue::FootnoteReference(ref name) => {
+            write_field(output, "name", name)?;
+        }
+        NodeValue::Table(ref alignments) => {
+            output.write_all(b",\"alignments\":[")?;
+            for (i, alignment) in alignments.iter().enumerate() {
+                if i > 0 {
+                    output.write_all(b",")?;
+                }
+                output.write_all(match *alignment {
+                    TableAlignment::None => b"\"none\"",
+                    TableAlignment::Left => b"\"left\"",
+                    TableAlignment::Center => b"\"center\"",
+                    TableAlignment::Right => b"\"right\"",
+                })?;
+            }
+            output.write_all(b"]")?;
+        }
+        NodeValue::TableRow(header) => {
+            write!(output, ",\"header\":{}", header)?;
+        }
+        NodeValue::TaskItem(checked) => {
+            write!(output, ",\"checked\":{}", checked)?;
+        }
+        NodeValue::Code(ref nc) => {
+            write!(output, ",\"num_backticks\":{}", nc.num_backticks)?;
+            write_field(output, "literal", &nc.literal)?;
+        }
+        NodeValue::Link(ref nl) | NodeValue::Image(ref nl) => {
+            write_field(output, "url", &nl.url)?;
+            write_field(output, "title", &nl.title)?;
+        }
+        NodeValue::Document
+        | NodeValue::BlockQuote
+        | NodeValue::DescriptionList
+        | NodeValue::DescriptionItem(..)
+        | NodeValue::DescriptionTerm
+        | NodeValue::DescriptionDetails
+        | NodeValue::Paragraph
+        | NodeValue::ThematicBreak
+        | NodeValue::TableCell
+        | NodeValue::SoftBreak
+        | NodeValue::LineBreak
+        | NodeValue::Emph
+        | NodeValue::Strong
+        | NodeValue::Strikethrough
+        | NodeValue::Superscript => (),
+    }
+
+    Ok(())
+}
+
+fn node_type(value: &NodeValue) -> &'static [u8] {
+    match *value {
+        NodeValue::Document => b"document",
+        NodeValue::FrontMatter(..) => b"front_matter",
+        NodeValue::BlockQuote => b"block_quote",
+        NodeValue::List(..) => b"list",
+        NodeValue::Item(..) => b"item",
+        NodeValue::DescriptionList => b"description_list",
+        NodeValue::DescriptionItem(..) => b"description_item",
+        NodeValue::DescriptionTerm => b"description_term",
+        NodeValue::DescriptionDetails => b"description_details",
+        NodeValue::CodeBlock(..) => b"code_block",
+        NodeValue::HtmlBlock(..) => b"html_block",
+        NodeValue::Paragraph => b"paragraph",
+        NodeValue::Heading(..) => b"heading",
+        NodeValue::ThematicBreak => b"thematic_break",
+        NodeValue::FootnoteDefinition(..) => b"footnote_definition",
+        NodeValue::Table(..) => b"table",
+        NodeValue::TableRow(..) => b"table_row",
+        NodeValue::TableCell => b"table_cell",
+        NodeValue::Text(..) => b"text",
+        NodeValue::TaskItem(..) => b"task_item",
+        NodeValue::SoftBreak => b"soft_break",
+        NodeValue::LineBreak => b"line_break",
+        NodeValue::Code(..) => b"code",
+        NodeValue::HtmlInline(..) => b"html_inline",
+        NodeValue::Emph => b"emph",
+        NodeValue::Strong => b"strong",
+        NodeValue::Strikethrough => b"strikethrough",
+        NodeValue::Superscript => b"superscript",
+        NodeValue::Link(..) => b"link",
+        NodeValue::Image(..) => b"image",
+        NodeValue::FootnoteReference(..) => b"footnote_reference",
+    }
+}
+
+// A list's bullet or a code block's fence character, empty if it has none.
+fn marker(c: &u8) -> &[u8] {
+    if *c == 0 {
+        &[]
+    } else {
+        slice::from_ref(c)
+    }
+}
+
+fn write_field(output: &mut dyn Write, name: &str, value: &[u8]) -> io::Result<()> {
+    write!(output, ",\"{}\":", name)?;
+    write_string(output, value)
+}
+
+// Writes `value` as a JSON string, replacing invalid UTF-8 with U+FFFD.
+fn write_string(output: &mut dyn Write, mut value: &[u8]) -> io::Result<()> {
+    output.write_all(b"\"")?;
+    loop {
+        match str::from_utf8(value) {
+            Ok(_) => {
+                escape(output, value)?;
+                break;
+            }
+            Err(e) => {
+                let (valid, rest) = value.split_at(e.valid_up_to());
+                escape(output, valid)?;
+                output.write_all("\u{fffd}".as_bytes())?;
+                value = &rest[e.error_len().unwrap_or(rest.len())..];
+            }
+        }
+    }
+    output.write_all(b"\"")
+}
+
+fn escape(output: &mut dyn Write, buffer: &[u8]) -> io::Result<()> {
+    let mut offset = 0;
+    for (i, &byte) in buffer.iter().enumerate() {
+        let esc: &[u8] = match byte {
+            b'"' => b"\\\"",
+            b'\\' => b"\\\\",
+            b'\n' => b"\\n",
+            b'\r' => b"\\r",
+            b'\t' => b"\\t",
+            0..=0x1f => {
+                output.write_all(&buffer[offset..i])?;
+                write!(output, "\\u{:04x}", byte)?;
+                offset = i + 1;
+                continue;
+            }
+            _ => continue,
+        };
+        output.write_all(&buffer[offset..i])?;
+        output.write_all(esc)?;
+        offset = i + 1;
+    }
+    output.write_all(&buffer[offset..])
+}
@@ -18,7 +18,7 @@
 //! ```
 //! extern crate comrak;
 //! use comrak::{Arena, parse_document, format_html, ComrakOptions};
-//! use comrak::nodes::{AstNode, NodeValue};
+//! use comrak::nodes::NodeValue;
 //!
 //! # fn main() {
 //! // The returned nodes are created in the supplied Arena, and are bound by its lifetime.
@@ -29,15 +29,8 @@
 //!     "This is my input.\n\n1. Also my input.\n2. Certainly my input.\n",
 //!     &ComrakOptions::default());
 //!
-//! fn iter_nodes<'a, F>(node: &'a AstNode<'a>, f: &F)
-//!     where F : Fn(&'a AstNode<'a>) {
-//!     f(node);
-//!     for c in node.children() {
-//!         iter_nodes(c, f);
-//!     }
-//! }
-//!
-//! iter_nodes(root, &|node| {
+//! // `descendants` walks the tree without recursing, so it's safe on arbitrarily deep input.
+//! for node in root.descendants() {
 //!     match &mut node.data.borrow_mut().value {
 //!         &mut NodeValue::Text(ref mut text) => {
 //!             let orig = std::mem::replace(text, vec![]);
@@ -45,7 +38,7 @@
 //!         }
 //!         _ => (),
 //!     }
-//! });
+//! }
 //!
 //! let mut html = vec![];
 //! format_html(root, &ComrakOptions::default(), &mut html).unwrap();
@@ -80,33 +73,54 @@ extern crate pest_derive;
 #[cfg(test)]
 extern crate propfuzz;
 extern crate regex;
+extern crate rustc_hash;
 #[cfg(feature = "benchmarks")]
 extern crate test;
 #[cfg(test)]
 extern crate timebomb;
+#[cfg(feature = "tokio")]
+extern crate tokio;
 extern crate twoway;
 extern crate typed_arena;
 extern crate unicode_categories;
 
+pub mod adapters;
 pub mod arena_tree;
+#[cfg(feature = "tokio")]
+mod chunked;
 mod cm;
 mod ctype;
 mod entity;
 mod html;
+mod json;
 pub mod nodes;
 mod parser;
+mod sanitizer;
 mod scanners;
 mod strings;
 #[cfg(test)]
 mod tests;
 
 pub use cm::format_document as format_commonmark;
+#[cfg(feature = "tokio")]
+pub use cm::{format_document_async as format_commonmark_async, FormatCommonMark};
 pub use html::format_document as format_html;
-pub use html::Anchorizer;
+pub use html::format_document_with_plugins as format_html_with_plugins;
+#[cfg(feature = "tokio")]
+pub use html::{
+    format_document_async as format_html_async,
+    format_document_with_plugins_async as format_html_with_plugins_async, FormatHtml,
+};
+pub use html::{Anchorizer, UrlSchemeFilter};
+pub use json::format_document as format_json;
 pub use parser::{
-    parse_document, parse_document_with_broken_link_callback, ComrakExtensionOptions,
-    ComrakOptions, ComrakParseOptions, ComrakRenderOptions,
+    parse_document, parse_document_until, parse_document_with_broken_link_callback,
+    parse_documents_with_broken_link_batch, BrokenLinkCache, ComrakExtensionOptions, ComrakOptions,
+    ComrakParseOptions, ComrakPlugins, ComrakRenderOptions, ComrakRenderPlugins,
+    ReferenceDefinitions,
 };
+pub use sanitizer::HtmlSanitizer;
+use std::io::{self, Write};
 pub use typed_arena::Arena;
 
 /// Render Markdown to HTML.
@@ -119,3 +133,47 @@ pub fn markdown_to_html(md: &str, options: &ComrakOptions) -> String {
     format_html(root, options, &mut s).unwrap();
     String::from_utf8(s).unwrap()
 }
+
+/// Render Markdown to HTML using plugins.
+///
+/// See [`SyntaxHighlighterAdapter`](adapters/trait.SyntaxHighlighterAdapter.html) for an example.
+pub fn markdown_to_html_with_plugins(
+    md: &str,
+    options: &ComrakOptions,
+    plugins: &ComrakPlugins,
+) -> String {
+    let arena = Arena::new();
+    let root = parse_document(&arena, md, options);
+    let mut s = Vec::new();
+    format_html_with_plugins(root, options, &mut s, plugins).unwrap();
+    String::from_utf8(s).unwrap()
+}
+
+/// Render Markdown to HTML, writing each top-level block to `output` as soon as it's parsed.
+///
+/// Tables at the top level of the document are written a row at a time, and each row is dropped
+/// once written, so even a table with millions of rows needs little memory.
+///
+/// Since nothing after a block has been read when it's written, links in it only resolve against
+/// the reference definitions that precede it (and any in
+/// [`ComrakParseOptions::reference_definitions`](struct.ComrakParseOptions.html#structfield.reference_definitions)),
+/// and footnote references only to the footnotes defined before them.  Otherwise the output is
+/// the same as that of `markdown_to_html`.
+///
+/// ```
+/// # use comrak::{markdown_to_html_streaming, ComrakOptions};
+/// let mut options = ComrakOptions::default();
+/// options.extension.table = true;
+/// let mut output = vec![];
+/// markdown_to_html_streaming("| a | b |\n|---|--:|\n| 1 | *2* |\n", &options, &mut output).unwrap();
+/// assert_eq!(String::from_utf8(output).unwrap(),
+///            "<table>\n<thead>\n<tr>\n<th>a</th>\n<th align=\"right\">b</th>\n</tr>\n</thead>\n\
+///             <tbody>\n<tr>\n<td>1</td>\n<td align=\"right\"><em>2</em></td>\n</tr>\n</tbody>\n</table>\n");
+/// ```
+pub fn markdown_to_html_streaming(
+    md: &str,
+    options: &ComrakOptions,
+    output: &mut dyn Write,
+) -> io::Result<()> {
+    html::stream_document(md, options, output)
+}
@@ -4,11 +4,21 @@ extern crate comrak;
 
 #[macro_use]
 extern crate clap;
+#[cfg(feature = "flate2")]
+extern crate flate2;
+#[cfg(target_os = "linux")]
+extern crate libc;
 extern crate shell_words;
 
 #[cfg(not(windows))]
 extern crate xdg;
+#[cfg(feature = "zstd")]
+extern crate zstd;
 
+#[cfg(target_os = "linux")]
+mod watch;
+
+use comrak::nodes::AstNode;
 use comrak::{
     Arena, ComrakExtensionOptions, ComrakOptions, ComrakParseOptions, ComrakRenderOptions,
 };
@@ -18,17 +28,44 @@ use std::collections::BTreeSet;
 use std::env;
 use std::error::Error;
 use std::fs;
-use std::io::Read;
+use std::io::{self, BufWriter, Read, Write};
+#[cfg(target_os = "linux")]
+use std::path::Path;
 use std::process;
 
 const EXIT_SUCCESS: i32 = 0;
 const EXIT_UNKNOWN_EXTENSION: i32 = 1;
 const EXIT_PARSE_CONFIG: i32 = 2;
 const EXIT_READ_INPUT: i32 = 3;
+#[cfg(not(target_os = "linux"))]
+const EXIT_UNSUPPORTED_WATCH: i32 = 5;
+#[cfg(target_os = "linux")]
+const EXIT_WATCH: i32 = 6;
+
+/// A function formatting a document, such as `comrak::format_html`.
+type Formatter = for<'a> fn(&'a AstNode<'a>, &ComrakOptions, &mut dyn Write) -> io::Result<()>;
 
 fn main() -> Result<(), Box<dyn Error>> {
     let default_config_path = get_default_config_path();
 
+    // --compress is only offered at all if some format was compiled in, and
+    // then only with those formats.
+    let compressions: Vec<&str> = ["gzip", "zstd"]
+        .iter()
+        .cloned()
+        .filter(|compression| Output::supports(compression))
+        .collect();
+    let compress = if compressions.is_empty() {
+        vec![]
+    } else {
+        vec![clap::Arg::with_name("compress")
+            .long("compress")
+            .takes_value(true)
+            .possible_values(&compressions)
+            .value_name("FORMAT")
+            .help("Compress the output as it's written")]
+    };
+
     let app = clap::App::new(crate_name!())
         .version(crate_version!())
         .author(crate_authors!())
@@ -115,7 +152,7 @@ if the file does not exist.\
                 .short("t")
                 .long("to")
                 .takes_value(true)
-                .possible_values(&["html", "commonmark"])
+                .possible_values(&["html", "commonmark", "json"])
                 .default_value("html")
                 .value_name("FORMAT")
                 .help("Specify output format"),
@@ -128,6 +165,24 @@ if the file does not exist.\
                 .value_name("FILE")
                 .help("Write output to FILE instead of stdout"),
         )
+        .args(&compress)
+        .arg(
+            clap::Arg::with_name("watch")
+                .long("watch")
+                .takes_value(true)
+                .value_name("DIR")
+                .requires("out-dir")
+                .conflicts_with_all(&["file", "output"])
+                .help("Render the Markdown files in DIR to --out-dir, then again as they change"),
+        )
+        .arg(
+            clap::Arg::with_name("out-dir")
+                .long("out-dir")
+                .takes_value(true)
+                .value_name("OUT")
+                .requires("watch")
+                .help("Write the files rendered by --watch to OUT"),
+        )
         .arg(
             clap::Arg::with_name("width")
                 .long("width")
@@ -198,6 +253,7 @@ if the file does not exist.\
             default_info_string: matches
                 .value_of("default-info-string")
                 .map(|e| e.to_owned()),
+            reference_definitions: None,
         },
         render: ComrakRenderOptions {
             hardbreaks: matches.is_present("hardbreaks"),
@@ -217,6 +273,38 @@ if the file does not exist.\
         process::exit(EXIT_UNKNOWN_EXTENSION);
     }
 
+    let formatter: Formatter = match matches.value_of("format") {
+        Some("html") => comrak::format_html,
+        Some("commonmark") => comrak::format_commonmark,
+        Some("json") => comrak::format_json,
+        _ => panic!("unknown format"),
+    };
+
+    let compression = matches.value_of("compress");
+
+    if let Some(dir) = matches.value_of("watch") {
+        let out_dir = matches.value_of("out-dir").unwrap();
+        #[cfg(target_os = "linux")]
+        {
+            let extension = match matches.value_of("format") {
+                Some("commonmark") => "md",
+                Some("json") => "json",
+                _ => "html",
+            };
+            let mut renderer = watch::Renderer::new(&options, formatter, extension, compression);
+            if let Err(e) = watch::watch(Path::new(dir), Path::new(out_dir), &mut renderer) {
+                eprintln!("failed to watch {}: {}", dir, e);
+                process::exit(EXIT_WATCH);
+            }
+        }
+        #[cfg(not(target_os = "linux"))]
+        {
+            let _ = (dir, out_dir);
+            eprintln!("--watch is only supported on Linux");
+            process::exit(EXIT_UNSUPPORTED_WATCH);
+        }
+    }
+
     let mut s: Vec<u8> = Vec::with_capacity(2048);
 
     match matches.values_of("file") {
@@ -241,21 +329,102 @@ if the file does not exist.\
     let arena = Arena::new();
     let root = comrak::parse_document(&arena, &String::from_utf8(s)?, &options);
 
-    let formatter = match matches.value_of("format") {
-        Some("html") => comrak::format_html,
-        Some("commonmark") => comrak::format_commonmark,
-        _ => panic!("unknown format"),
-    };
-
-    if let Some(output_filename) = matches.value_of("output") {
-        formatter(root, &options, &mut fs::File::create(output_filename)?)?;
+    let output: Box<dyn Write> = if let Some(output_filename) = matches.value_of("output") {
+        Box::new(BufWriter::new(fs::File::create(output_filename)?))
     } else {
-        formatter(root, &options, &mut std::io::stdout())?;
+        Box::new(BufWriter::new(io::stdout()))
     };
+    let mut output = Output::new(output, compression)?;
+    formatter(root, &options, &mut output)?;
+    output.finish()?;
 
     process::exit(EXIT_SUCCESS);
 }
 
+/// Where the formatted document goes, compressed as it's written if asked.
+enum Output {
+    Plain(Box<dyn Write>),
+    #[cfg(feature = "flate2")]
+    Gzip(flate2::write::GzEncoder<Box<dyn Write>>),
+    #[cfg(feature = "zstd")]
+    Zstd(zstd::Encoder<'static, Box<dyn Write>>),
+}
+
+impl Output {
+    /// Whether `compression` was compiled in.
+    fn supports(compression: &str) -> bool {
+        match compression {
+            #[cfg(feature = "flate2")]
+            "gzip" => true,
+            #[cfg(feature = "zstd")]
+            "zstd" => true,
+            _ => false,
+        }
+    }
+
+    /// Wraps `output` in an encoder for `compression`, which must be supported.
+    fn new(output: Box<dyn Write>, compression: Option<&str>) -> io::Result<Output> {
+        match compression {
+            None => Ok(Output::Plain(output)),
+            #[cfg(feature = "flate2")]
+            Some("gzip") => Ok(Output::Gzip(flate2::write::GzEncoder::new(
+                output,
+                flate2::Compression::default(),
+            ))),
+            #[cfg(feature = "zstd")]
+            Some("zstd") => Ok(Output::Zstd(zstd::Encoder::new(output, 0)?)),
+            Some(compression) => Err(io::Error::new(
+                io::ErrorKind::Other,
+                format!("unsupported compression: {}", compression),
+            )),
+        }
+    }
+
+    /// The suffix added to the names of files compressed with `compression`.
+    #[cfg(target_os = "linux")]
+    fn suffix(compression: Option<&str>) -> &'static str {
+        match compression {
+            Some("gzip") => ".gz",
+            Some("zstd") => ".zst",
+            _ => "",
+        }
+    }
+
+    /// Writes out anything still buffered, including the compressed stream's trailer.  Must be
+    /// called before exiting, as `process::exit` doesn't run destructors.
+    fn finish(self) -> io::Result<()> {
+        match self {
+            Output::Plain(mut output) => output.flush(),
+            #[cfg(feature = "flate2")]
+            Output::Gzip(encoder) => encoder.finish()?.flush(),
+            #[cfg(feature = "zstd")]
+            Output::Zstd(encoder) => encoder.finish()?.flush(),
+        }
+    }
+}
+
+impl Write for Output {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match *self {
+            Output::Plain(ref mut output) => output.write(buf),
+            #[cfg(feature = "flate2")]
+            Output::Gzip(ref mut encoder) => encoder.write(buf),
+            #[cfg(feature = "zstd")]
+            Output::Zstd(ref mut encoder) => encoder.write(buf),
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match *self {
+            Output::Plain(ref mut output) => output.flush(),
+            #[cfg(feature = "flate2")]
+            Output::Gzip(ref mut encoder) => encoder.flush(),
+            #[cfg(feature = "zstd")]
+            Output::Zstd(ref mut encoder) => encoder.flush(),
+        }
+    }
+}
+
 #[cfg(not(windows))]
 fn get_default_config_path() -> String {
     if let Ok(xdg_dirs) = xdg::BaseDirectories::with_prefix("comrak") {
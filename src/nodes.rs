@@ -365,6 +365,9 @@ pub struct Ast {
     /// The line in the input document the node starts at.
     pub start_line: u32,
 
+    // The block's raw text while it's being parsed.  Once the inlines of a
+    // paragraph, heading or table cell have been parsed from it, it's left
+    // empty.
     pub(crate) content: Vec<u8>,
     pub(crate) open: bool,
     pub(crate) last_line_blank: bool,
@@ -476,14 +479,3 @@ pub(crate) fn ends_with_blank_line<'a>(node: &'a AstNode<'a>) -> bool {
     }
     false
 }
-
-pub(crate) fn containing_block<'a>(node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
-    let mut ch = Some(node);
-    while let Some(n) = ch {
-        if n.data.borrow().value.block() {
-            return Some(n);
-        }
-        ch = n.parent();
-    }
-    None
-}
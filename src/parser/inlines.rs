@@ -1,52 +1,71 @@
 use arena_tree::Node;
-use ctype::{ispunct, isspace};
+use ctype::{self, ispunct, isspace, Flanking};
 use entity;
 use nodes::{Ast, AstNode, NodeCode, NodeLink, NodeValue};
 use parser::{unwrap_into_2, unwrap_into_copy, AutolinkType, Callback, ComrakOptions, Reference};
+use rustc_hash::FxHashMap;
 use scanners;
-use std::cell::{Cell, RefCell};
-use std::collections::HashMap;
-use std::ptr;
+use std::cell::RefCell;
+use std::mem;
 use std::str;
 use strings;
 use typed_arena::Arena;
-use unicode_categories::UnicodeCategories;
 
 const MAXBACKTICKS: usize = 80;
 const MAX_LINK_LABEL_LENGTH: usize = 1000;
 
-pub struct Subject<'a: 'd, 'r, 'o, 'd, 'i, 'c: 'subj, 'subj> {
+pub struct Subject<'a, 'r, 'o, 'c: 'subj, 'subj> {
     pub arena: &'a Arena<AstNode<'a>>,
     options: &'o ComrakOptions,
-    pub input: &'i [u8],
+    pub input: Vec<u8>,
     pub pos: usize,
-    pub refmap: &'r mut HashMap<Vec<u8>, Reference>,
-    delimiter_arena: &'d Arena<Delimiter<'a, 'd>>,
-    last_delimiter: Option<&'d Delimiter<'a, 'd>>,
-    brackets: Vec<Bracket<'a, 'd>>,
+    pub refmap: &'r mut FxHashMap<Vec<u8>, Reference>,
+    // The delimiter "stack" is a doubly-linked list threaded through this
+    // vector by index. Entries are only ever appended at the end, and once
+    // `process_emphasis` has consumed everything above a given stack bottom
+    // the vector is truncated back down, so its storage is reused from one
+    // block to the next.
+    delimiters: Vec<Delimiter<'a>>,
+    last_delimiter: Option<usize>,
+    brackets: Vec<Bracket<'a>>,
     pub backticks: [usize; MAXBACKTICKS + 1],
     pub scanned_for_backticks: bool,
     special_chars: [bool; 256],
     skip_chars: [bool; 256],
     smart_chars: [bool; 256],
+    // The number given to each defined footnote by normalized name, if it's
+    // been referenced yet, and the number of distinct footnotes referenced so
+    // far; references are numbered as they're parsed.
+    pub footnotes: FxHashMap<Vec<u8>, Option<u32>>,
+    pub footnote_ix: u32,
+    // Scratch buffer for normalizing link labels, so that looking one up in
+    // the refmap doesn't allocate.
+    label: Vec<u8>,
+    // When broken links are resolved in a batch, the batch's results by
+    // normalized label.  They're borrowed from the batch rather than copied,
+    // so they take no room per document.
+    pub broken_links: Option<&'r FxHashMap<Vec<u8>, Option<(Vec<u8>, Vec<u8>)>>>,
+    // The labels of broken links with no result yet, in the order they're
+    // found, when there's no callback and they're to be resolved in a batch.
+    pub broken_labels: Option<Vec<Vec<u8>>>,
     // Need to borrow the callback from the parser only for the lifetime of the Subject, 'subj, and
     // then give it back when the Subject goes out of scope. Needs to be a mutable reference so we
     // can call the FnMut and let it mutate its captured variables.
     callback: Option<&'subj mut Callback<'c>>,
 }
 
-pub struct Delimiter<'a: 'd, 'd> {
+pub struct Delimiter<'a> {
     inl: &'a AstNode<'a>,
     length: usize,
     delim_char: u8,
     can_open: bool,
     can_close: bool,
-    prev: Cell<Option<&'d Delimiter<'a, 'd>>>,
-    next: Cell<Option<&'d Delimiter<'a, 'd>>>,
+    prev: Option<usize>,
+    next: Option<usize>,
 }
 
-struct Bracket<'a: 'd, 'd> {
-    previous_delimiter: Option<&'d Delimiter<'a, 'd>>,
+struct Bracket<'a> {
+    previous_delimiter: Option<usize>,
     inl_text: &'a AstNode<'a>,
     position: usize,
     image: bool,
@@ -54,30 +73,43 @@ struct Bracket<'a: 'd, 'd> {
     bracket_after: bool,
 }
 
-impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
-    pub fn new(
-        arena: &'a Arena<AstNode<'a>>,
-        options: &'o ComrakOptions,
-        input: &'i [u8],
-        refmap: &'r mut HashMap<Vec<u8>, Reference>,
-        delimiter_arena: &'d Arena<Delimiter<'a, 'd>>,
-        callback: Option<&'subj mut Callback<'c>>,
-    ) -> Self {
-        let mut s = Subject {
-            arena,
-            options,
-            input,
-            pos: 0,
-            refmap,
-            delimiter_arena,
-            last_delimiter: None,
-            brackets: vec![],
-            backticks: [0; MAXBACKTICKS + 1],
-            scanned_for_backticks: false,
+// Only these characters are ever pushed onto the delimiter stack, so
+// `process_emphasis` indexes its `openers_bottom` table by their position
+// here rather than by the byte itself.
+const DELIM_CHARS: [u8; 6] = [b'*', b'_', b'\'', b'"', b'~', b'^'];
+
+#[inline]
+fn delim_char_index(c: u8) -> usize {
+    match c {
+        b'*' => 0,
+        b'_' => 1,
+        b'\'' => 2,
+        b'"' => 3,
+        b'~' => 4,
+        b'^' => 5,
+        _ => unreachable!(),
+    }
+}
+
+// The parts of a `Subject` that neither point into an arena nor borrow from
+// the parser: its character tables, which depend only on the options, and
+// its label buffer.  A parser that needs a new subject per block (or per
+// table row, each in an arena of its own) hands these from one to the next
+// rather than building them again.
+pub struct Scratch {
+    special_chars: [bool; 256],
+    skip_chars: [bool; 256],
+    smart_chars: [bool; 256],
+    label: Vec<u8>,
+}
+
+impl Scratch {
+    pub fn new(options: &ComrakOptions) -> Self {
+        let mut s = Scratch {
             special_chars: [false; 256],
             skip_chars: [false; 256],
             smart_chars: [false; 256],
-            callback,
+            label: vec![],
         };
         for &c in &[
             b'\n', b'\r', b'_', b'*', b'"', b'`', b'\\', b'&', b'<', b'[', b']', b'!',
@@ -96,9 +128,82 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         }
         s
     }
+}
+
+impl<'a, 'r, 'o, 'c, 'subj> Subject<'a, 'r, 'o, 'c, 'subj> {
+    pub fn new(
+        arena: &'a Arena<AstNode<'a>>,
+        options: &'o ComrakOptions,
+        input: Vec<u8>,
+        refmap: &'r mut FxHashMap<Vec<u8>, Reference>,
+        callback: Option<&'subj mut Callback<'c>>,
+    ) -> Self {
+        let mut s = Self::with_scratch(arena, options, Scratch::new(options), refmap, callback);
+        s.input = input;
+        s
+    }
+
+    // As `new`, with the tables and buffers of an earlier subject, and no
+    // input until `reset` is called.
+    pub fn with_scratch(
+        arena: &'a Arena<AstNode<'a>>,
+        options: &'o ComrakOptions,
+        scratch: Scratch,
+        refmap: &'r mut FxHashMap<Vec<u8>, Reference>,
+        callback: Option<&'subj mut Callback<'c>>,
+    ) -> Self {
+        Subject {
+            arena,
+            options,
+            input: vec![],
+            pos: 0,
+            refmap,
+            delimiters: vec![],
+            last_delimiter: None,
+            brackets: vec![],
+            backticks: [0; MAXBACKTICKS + 1],
+            scanned_for_backticks: false,
+            special_chars: scratch.special_chars,
+            skip_chars: scratch.skip_chars,
+            smart_chars: scratch.smart_chars,
+            footnotes: FxHashMap::default(),
+            label: scratch.label,
+            broken_links: None,
+            broken_labels: None,
+            footnote_ix: 0,
+            callback,
+        }
+    }
+
+    // Gives up the subject, keeping what `with_scratch` can reuse.
+    pub fn into_scratch(self) -> Scratch {
+        Scratch {
+            special_chars: self.special_chars,
+            skip_chars: self.skip_chars,
+            smart_chars: self.smart_chars,
+            label: self.label,
+        }
+    }
+
+    // Point the subject at a new input, so one `Subject` (with its character
+    // tables and stack storage) can be used for every block in a document.
+    // Returns the previous input.
+    pub fn reset(&mut self, input: Vec<u8>) -> Vec<u8> {
+        debug_assert!(self.last_delimiter.is_none() && self.brackets.is_empty());
+        self.pos = 0;
+        self.delimiters.clear();
+        self.backticks = [0; MAXBACKTICKS + 1];
+        self.scanned_for_backticks = false;
+        mem::replace(&mut self.input, input)
+    }
+
+    // Parse the whole of the current input as the inline content of `node`.
+    pub fn parse_block(&mut self, node: &'a AstNode<'a>) {
+        while self.parse_inline(node) {}
+
+        self.process_emphasis(None);
 
-    pub fn pop_bracket(&mut self) -> bool {
-        self.brackets.pop().is_some()
+        self.brackets.clear();
     }
 
     pub fn parse_inline(&mut self, node: &'a AstNode<'a>) -> bool {
@@ -111,20 +216,20 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         match c {
             '\0' => return false,
             '\r' | '\n' => new_inl = Some(self.handle_newline()),
-            '`' => new_inl = Some(self.handle_backticks()),
-            '\\' => new_inl = Some(self.handle_backslash()),
-            '&' => new_inl = Some(self.handle_entity()),
-            '<' => new_inl = Some(self.handle_pointy_brace()),
+            '`' => new_inl = self.handle_backticks(node),
+            '\\' => new_inl = self.handle_backslash(node),
+            '&' => new_inl = self.handle_entity(node),
+            '<' => new_inl = self.handle_pointy_brace(node),
             '*' | '_' | '\'' | '"' => new_inl = Some(self.handle_delim(c as u8)),
-            '-' => new_inl = Some(self.handle_hyphen()),
-            '.' => new_inl = Some(self.handle_period()),
+            '-' => new_inl = self.handle_hyphen(node),
+            '.' => new_inl = self.handle_period(node),
             '[' => {
                 self.pos += 1;
                 let inl = make_inline(self.arena, NodeValue::Text(b"[".to_vec()));
                 new_inl = Some(inl);
                 self.push_bracket(false, inl);
             }
-            ']' => new_inl = self.handle_close_bracket(),
+            ']' => new_inl = self.handle_close_bracket(node),
             '!' => {
                 self.pos += 1;
                 if self.peek_char() == Some(&(b'[')) && self.peek_char_n(1) != Some(&(b'^')) {
@@ -133,7 +238,8 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                     new_inl = Some(inl);
                     self.push_bracket(true, inl);
                 } else {
-                    new_inl = Some(make_inline(self.arena, NodeValue::Text(b"!".to_vec())));
+                    self.push_text(node, b"!");
+                    new_inl = None;
                 }
             }
             _ => {
@@ -142,18 +248,21 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 } else if self.options.extension.superscript && c == '^' {
                     new_inl = Some(self.handle_delim(b'^'));
                 } else {
-                    let endpos = self.find_special_char();
-                    let mut contents = self.input[self.pos..endpos].to_vec();
+                    let startpos = self.pos;
+                    let mut endpos = self.find_special_char();
                     self.pos = endpos;
 
                     if self
                         .peek_char()
                         .map_or(false, |&c| strings::is_line_end_char(c))
                     {
-                        strings::rtrim(&mut contents);
+                        while endpos > startpos && isspace(self.input[endpos - 1]) {
+                            endpos -= 1;
+                        }
                     }
 
-                    new_inl = Some(make_inline(self.arena, NodeValue::Text(contents)));
+                    self.push_text(node, &self.input[startpos..endpos]);
+                    new_inl = None;
                 }
             }
         }
@@ -165,12 +274,31 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         true
     }
 
-    fn del_ref_eq(lhs: Option<&'d Delimiter<'a, 'd>>, rhs: Option<&'d Delimiter<'a, 'd>>) -> bool {
-        match (lhs, rhs) {
-            (None, None) => true,
-            (Some(l), Some(r)) => ptr::eq(l, r),
-            _ => false,
+    // Appends literal text to `node`. Where the last child is already plain
+    // text, the new text is added to it rather than given a node of its own,
+    // so runs broken up by escapes, entities, stray brackets and the like
+    // don't each cost a node and allocation only to be merged again in
+    // `postprocess_text_nodes`.
+    //
+    // Text that is part of a delimiter or bracket has to remain its own node,
+    // as does everything after an open bracket: footnote references are
+    // recognised by there being exactly one Text node following the bracket.
+    fn push_text(&self, node: &'a AstNode<'a>, contents: &[u8]) {
+        if self.brackets.is_empty() {
+            if let Some(last) = node.last_child() {
+                let is_delimiter = self
+                    .last_delimiter
+                    .map_or(false, |d| self.delimiters[d].inl.same_node(last));
+                if !is_delimiter {
+                    if let NodeValue::Text(ref mut text) = last.data.borrow_mut().value {
+                        text.extend_from_slice(contents);
+                        return;
+                    }
+                }
+            }
         }
+
+        node.append(make_inline(self.arena, NodeValue::Text(contents.to_vec())));
     }
 
     // After parsing a block (and sometimes during), this function traverses the
@@ -181,8 +309,9 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
     // etc AST nodes.
     //
     // The term stack here is a bit of a misnomer, as the `Delimiters` actually
-    // form a doubly-linked list. Items are pushed onto the stack during parsing,
-    // but during post-processing are removed from arbitrary locations.
+    // form a doubly-linked list (threaded by index through `self.delimiters`).
+    // Items are pushed onto the stack during parsing, but during
+    // post-processing are removed from arbitrary locations.
     //
     // The `Delimiter` contains references AST `Text` nodes, which are also
     // linked into the AST as siblings in the order they are parsed. This
@@ -222,41 +351,38 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
     // different emphasis. Note also that "_"- and "*"-delimited regions have
     // complex rules for which can be opening and/or closing delimiters,
     // determined in `scan_delims`.
-    pub fn process_emphasis(&mut self, stack_bottom: Option<&'d Delimiter<'a, 'd>>) {
+    pub fn process_emphasis(&mut self, stack_bottom: Option<usize>) {
         let mut closer = self.last_delimiter;
 
         // This array is an important optimization that prevents searching down
         // the stack for openers we've previously searched for and know don't
         // exist, preventing exponential blowup on pathological cases.
-        let mut openers_bottom: [[Option<&'d Delimiter<'a, 'd>>; 128]; 3] = [[None; 128]; 3];
-        for i in &mut openers_bottom {
-            i['*' as usize] = stack_bottom;
-            i['_' as usize] = stack_bottom;
-            i['\'' as usize] = stack_bottom;
-            i['"' as usize] = stack_bottom;
-            if self.options.extension.strikethrough {
-                i['~' as usize] = stack_bottom;
-            }
-            if self.options.extension.superscript {
-                i['^' as usize] = stack_bottom;
-            }
-        }
+        let mut openers_bottom: [[Option<usize>; DELIM_CHARS.len()]; 3] =
+            [[stack_bottom; DELIM_CHARS.len()]; 3];
 
         // This is traversing the stack from the top to the bottom, setting `closer` to
         // the delimiter directly above `stack_bottom`. In the case where we are processing
         // emphasis on an entire block, `stack_bottom` is `None`, so `closer` references
         // the very bottom of the stack.
-        while closer.is_some() && !Self::del_ref_eq(closer.unwrap().prev.get(), stack_bottom) {
-            closer = closer.unwrap().prev.get();
+        while let Some(c) = closer {
+            if self.delimiters[c].prev == stack_bottom {
+                break;
+            }
+            closer = self.delimiters[c].prev;
         }
 
-        while closer.is_some() {
-            if closer.unwrap().can_close {
+        while let Some(c) = closer {
+            let (closer_length, closer_char) = {
+                let d = &self.delimiters[c];
+                (d.length, d.delim_char)
+            };
+
+            if self.delimiters[c].can_close {
                 // Each time through the outer `closer` loop we reset the opener
                 // to the element below the closer, and search down the stack
                 // for a matching opener.
 
-                let mut opener = closer.unwrap().prev.get();
+                let mut opener = self.delimiters[c].prev;
                 let mut opener_found = false;
 
                 // Here's where we find the opener by searching down the stack,
@@ -270,16 +396,13 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 // This search short-circuits for openers we've previously
                 // failed to find, avoiding repeatedly rescanning the bottom of
                 // the stack, using the openers_bottom array.
-                while opener.is_some()
-                    && !Self::del_ref_eq(
-                        opener,
-                        openers_bottom[closer.unwrap().length % 3]
-                            [closer.unwrap().delim_char as usize],
-                    )
-                {
-                    if opener.unwrap().can_open
-                        && opener.unwrap().delim_char == closer.unwrap().delim_char
-                    {
+                let bottom = openers_bottom[closer_length % 3][delim_char_index(closer_char)];
+                while let Some(o) = opener {
+                    if Some(o) == bottom {
+                        break;
+                    }
+                    let od = &self.delimiters[o];
+                    if od.can_open && od.delim_char == closer_char {
                         // This is a bit convoluted; see points 9 and 10 here:
                         // http://spec.commonmark.org/0.28/#can-open-emphasis.
                         // This is to aid processing of runs like this:
@@ -289,27 +412,26 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                         // that matches the last ** or *, we need to skip it,
                         // and this algorithm ensures we do. (The sum of the
                         // lengths are a multiple of 3.)
-                        let odd_match = (closer.unwrap().can_open || opener.unwrap().can_close)
-                            && ((opener.unwrap().length + closer.unwrap().length) % 3 == 0)
-                            && !(opener.unwrap().length % 3 == 0
-                                && closer.unwrap().length % 3 == 0);
+                        let odd_match = (self.delimiters[c].can_open || od.can_close)
+                            && ((od.length + closer_length) % 3 == 0)
+                            && !(od.length % 3 == 0 && closer_length % 3 == 0);
                         if !odd_match {
                             opener_found = true;
                             break;
                         }
                     }
-                    opener = opener.unwrap().prev.get();
+                    opener = od.prev;
                 }
 
-                let old_closer = closer;
+                let old_closer = c;
 
                 // There's a case here for every possible delimiter. If we found
                 // a matching opening delimiter for our closing delimiter, they
                 // both get passed.
-                if closer.unwrap().delim_char == b'*'
-                    || closer.unwrap().delim_char == b'_'
-                    || (self.options.extension.strikethrough && closer.unwrap().delim_char == b'~')
-                    || (self.options.extension.superscript && closer.unwrap().delim_char == b'^')
+                if closer_char == b'*'
+                    || closer_char == b'_'
+                    || (self.options.extension.strikethrough && closer_char == b'~')
+                    || (self.options.extension.superscript && closer_char == b'^')
                 {
                     if opener_found {
                         // Finally, here's the happy case where the delimiters
@@ -325,53 +447,49 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                         //
                         // In general though the closer will be the next
                         // delimiter up the stack.
-                        closer = self.insert_emph(opener.unwrap(), closer.unwrap());
+                        closer = self.insert_emph(opener.unwrap(), c);
                     } else {
                         // When no matching opener is found we move the closer
                         // up the stack, do some bookkeeping with old_closer
                         // (below), try again.
-                        closer = closer.unwrap().next.get();
+                        closer = self.delimiters[c].next;
                     }
-                } else if closer.unwrap().delim_char == b'\'' {
-                    *closer
-                        .unwrap()
+                } else if closer_char == b'\'' {
+                    *self.delimiters[c]
                         .inl
                         .data
                         .borrow_mut()
                         .value
                         .text_mut()
-                        .unwrap() = "’".to_string().into_bytes();
+                        .unwrap() = b"\xE2\x80\x99".to_vec();
                     if opener_found {
-                        *opener
-                            .unwrap()
+                        *self.delimiters[opener.unwrap()]
                             .inl
                             .data
                             .borrow_mut()
                             .value
                             .text_mut()
-                            .unwrap() = "‘".to_string().into_bytes();
+                            .unwrap() = b"\xE2\x80\x98".to_vec();
                     }
-                    closer = closer.unwrap().next.get();
-                } else if closer.unwrap().delim_char == b'"' {
-                    *closer
-                        .unwrap()
+                    closer = self.delimiters[c].next;
+                } else if closer_char == b'"' {
+                    *self.delimiters[c]
                         .inl
                         .data
                         .borrow_mut()
                         .value
                         .text_mut()
-                        .unwrap() = "”".to_string().into_bytes();
+                        .unwrap() = b"\xE2\x80\x9D".to_vec();
                     if opener_found {
-                        *opener
-                            .unwrap()
+                        *self.delimiters[opener.unwrap()]
                             .inl
                             .data
                             .borrow_mut()
                             .value
                             .text_mut()
-                            .unwrap() = "“".to_string().into_bytes();
+                            .unwrap() = b"\xE2\x80\x9C".to_vec();
                     }
-                    closer = closer.unwrap().next.get();
+                    closer = self.delimiters[c].next;
                 }
 
                 // If the search for an opener was unsuccessful, then record
@@ -379,44 +497,51 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 // so that the `opener` search can avoid looking for this
                 // same opener at the bottom of the stack later.
                 if !opener_found {
-                    let ix = old_closer.unwrap().length % 3;
-                    openers_bottom[ix][old_closer.unwrap().delim_char as usize] =
-                        old_closer.unwrap().prev.get();
+                    openers_bottom[closer_length % 3][delim_char_index(closer_char)] =
+                        self.delimiters[old_closer].prev;
 
                     // Now that we've failed the `opener` search starting from
                     // `old_closer`, future opener searches will be searching it
                     // for openers - if `old_closer` can't be used as an opener
                     // then we know it's just text - remove it from the
                     // delimiter stack, leaving it in the AST as text
-                    if !old_closer.unwrap().can_open {
-                        self.remove_delimiter(old_closer.unwrap());
+                    if !self.delimiters[old_closer].can_open {
+                        self.remove_delimiter(old_closer);
                     }
                 }
             } else {
                 // Closer is !can_close. Move up the stack
-                closer = closer.unwrap().next.get();
+                closer = self.delimiters[c].next;
             }
         }
 
         // At this point the entire delimiter stack from `stack_bottom` up has
         // been scanned for matches, everything left is just text. Pop it all
         // off.
-        while self.last_delimiter.is_some() && !Self::del_ref_eq(self.last_delimiter, stack_bottom)
-        {
+        while self.last_delimiter.is_some() && self.last_delimiter != stack_bottom {
             let last_del = self.last_delimiter.unwrap();
             self.remove_delimiter(last_del);
         }
+
+        // Every entry above `stack_bottom` is now unlinked, and nothing still
+        // on the bracket stack refers to one, so their slots can be reused.
+        self.delimiters.truncate(stack_bottom.map_or(0, |d| d + 1));
     }
 
-    fn remove_delimiter(&mut self, delimiter: &'d Delimiter<'a, 'd>) {
-        if delimiter.next.get().is_none() {
-            assert!(ptr::eq(delimiter, self.last_delimiter.unwrap()));
-            self.last_delimiter = delimiter.prev.get();
-        } else {
-            delimiter.next.get().unwrap().prev.set(delimiter.prev.get());
+    fn remove_delimiter(&mut self, delimiter: usize) {
+        let (prev, next) = {
+            let d = &self.delimiters[delimiter];
+            (d.prev, d.next)
+        };
+        match next {
+            None => {
+                assert_eq!(Some(delimiter), self.last_delimiter);
+                self.last_delimiter = prev;
+            }
+            Some(n) => self.delimiters[n].prev = prev,
         }
-        if delimiter.prev.get().is_some() {
-            delimiter.prev.get().unwrap().next.set(delimiter.next.get());
+        if let Some(p) = prev {
+            self.delimiters[p].next = next;
         }
     }
 
@@ -505,7 +630,7 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         }
     }
 
-    pub fn handle_backticks(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_backticks(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         let openticks = self.take_while(b'`');
         let startpos = self.pos;
         let endpos = self.scan_to_closing_backtick(openticks);
@@ -513,16 +638,16 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         match endpos {
             None => {
                 self.pos = startpos;
-                make_inline(self.arena, NodeValue::Text(vec![b'`'; openticks]))
+                self.push_text(node, &self.input[startpos - openticks..startpos]);
+                None
             }
             Some(endpos) => {
                 let buf = &self.input[startpos..endpos - openticks];
-                let buf = strings::normalize_code(buf);
                 let code = NodeCode {
                     num_backticks: openticks,
-                    literal: buf,
+                    literal: strings::normalize_code(buf).into_owned(),
                 };
-                make_inline(self.arena, NodeValue::Code(code))
+                Some(make_inline(self.arena, NodeValue::Code(code)))
             }
         }
     }
@@ -559,12 +684,13 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         inl
     }
 
-    pub fn handle_hyphen(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_hyphen(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         let start = self.pos;
         self.pos += 1;
 
         if !self.options.parse.smart || self.peek_char().map_or(false, |&c| c != b'-') {
-            return make_inline(self.arena, NodeValue::Text(vec![b'-']));
+            self.push_text(node, b"-");
+            return None;
         }
 
         while self.options.parse.smart && self.peek_char().map_or(false, |&c| c == b'-') {
@@ -583,7 +709,7 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
             (2, (numhyphens - 4) / 3)
         };
 
-        let mut buf = vec![];
+        let mut buf = Vec::with_capacity(3 * (ems + ens) as usize);
         for _ in 0..ems {
             buf.extend_from_slice(b"\xE2\x80\x94");
         }
@@ -591,22 +717,26 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
             buf.extend_from_slice(b"\xE2\x80\x93");
         }
 
-        make_inline(self.arena, NodeValue::Text(buf))
+        self.push_text(node, &buf);
+        None
     }
 
-    pub fn handle_period(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_period(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         self.pos += 1;
-        if self.options.parse.smart && self.peek_char().map_or(false, |&c| c == b'.') {
-            self.pos += 1;
-            if self.peek_char().map_or(false, |&c| c == b'.') {
+        let contents: &[u8] =
+            if self.options.parse.smart && self.peek_char().map_or(false, |&c| c == b'.') {
                 self.pos += 1;
-                make_inline(self.arena, NodeValue::Text(b"\xE2\x80\xA6".to_vec()))
+                if self.peek_char().map_or(false, |&c| c == b'.') {
+                    self.pos += 1;
+                    b"\xE2\x80\xA6"
+                } else {
+                    b".."
+                }
             } else {
-                make_inline(self.arena, NodeValue::Text(b"..".to_vec()))
-            }
-        } else {
-            make_inline(self.arena, NodeValue::Text(b".".to_vec()))
-        }
+                b"."
+            };
+        self.push_text(node, contents);
+        None
     }
 
     pub fn scan_delims(&mut self, c: u8) -> (usize, bool, bool) {
@@ -620,19 +750,7 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
             {
                 before_char_pos -= 1;
             }
-            match unsafe { str::from_utf8_unchecked(&self.input[before_char_pos..self.pos]) }
-                .chars()
-                .next()
-            {
-                Some(x) => {
-                    if (x as usize) < 256 && self.skip_chars[x as usize] {
-                        '\n'
-                    } else {
-                        x
-                    }
-                }
-                None => '\n',
-            }
+            self.delim_neighbour(before_char_pos)
         };
 
         let mut numdelims = 0;
@@ -655,37 +773,24 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
             {
                 after_char_pos += 1;
             }
-            match unsafe { str::from_utf8_unchecked(&self.input[after_char_pos..]) }
-                .chars()
-                .next()
-            {
-                Some(x) => {
-                    if (x as usize) < 256 && self.skip_chars[x as usize] {
-                        '\n'
-                    } else {
-                        x
-                    }
-                }
-                None => '\n',
-            }
+            self.delim_neighbour(after_char_pos)
         };
 
+        let before = ctype::flanking(before_char);
+        let after = ctype::flanking(after_char);
+
         let left_flanking = numdelims > 0
-            && !after_char.is_whitespace()
-            && !(after_char.is_punctuation()
-                && !before_char.is_whitespace()
-                && !before_char.is_punctuation());
+            && after != Flanking::Whitespace
+            && !(after == Flanking::Punctuation && before == Flanking::Other);
         let right_flanking = numdelims > 0
-            && !before_char.is_whitespace()
-            && !(before_char.is_punctuation()
-                && !after_char.is_whitespace()
-                && !after_char.is_punctuation());
+            && before != Flanking::Whitespace
+            && !(before == Flanking::Punctuation && after == Flanking::Other);
 
         if c == b'_' {
             (
                 numdelims,
-                left_flanking && (!right_flanking || before_char.is_punctuation()),
-                right_flanking && (!left_flanking || after_char.is_punctuation()),
+                left_flanking && (!right_flanking || before == Flanking::Punctuation),
+                right_flanking && (!left_flanking || after == Flanking::Punctuation),
             )
         } else if c == b'\'' || c == b'"' {
             (
@@ -698,18 +803,38 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         }
     }
 
+    // The character starting at `pos`, as seen by a delimiter run next to it;
+    // one that the subject skips counts as a line ending.
+    fn delim_neighbour(&self, pos: usize) -> char {
+        let b = self.input[pos];
+        let c = if b < 0x80 {
+            b as char
+        } else {
+            unsafe { str::from_utf8_unchecked(&self.input[pos..]) }
+                .chars()
+                .next()
+                .unwrap()
+        };
+        if (c as usize) < 256 && self.skip_chars[c as usize] {
+            '\n'
+        } else {
+            c
+        }
+    }
+
     pub fn push_delimiter(&mut self, c: u8, can_open: bool, can_close: bool, inl: &'a AstNode<'a>) {
-        let d = self.delimiter_arena.alloc(Delimiter {
-            prev: Cell::new(self.last_delimiter),
-            next: Cell::new(None),
+        let d = self.delimiters.len();
+        self.delimiters.push(Delimiter {
+            prev: self.last_delimiter,
+            next: None,
             inl,
             length: inl.data.borrow().value.text().unwrap().len(),
             delim_char: c,
             can_open,
             can_close,
         });
-        if d.prev.get().is_some() {
-            d.prev.get().unwrap().next.set(Some(d));
+        if let Some(prev) = self.last_delimiter {
+            self.delimiters[prev].next = Some(d);
         }
         self.last_delimiter = Some(d);
     }
@@ -719,14 +844,12 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
     //
     // As a side-effect, handle long "***" and "___" nodes by truncating them in
     // place to be re-matched by `process_emphasis`.
-    pub fn insert_emph(
-        &mut self,
-        opener: &'d Delimiter<'a, 'd>,
-        closer: &'d Delimiter<'a, 'd>,
-    ) -> Option<&'d Delimiter<'a, 'd>> {
-        let opener_char = opener.inl.data.borrow().value.text().unwrap()[0];
-        let mut opener_num_chars = opener.inl.data.borrow().value.text().unwrap().len();
-        let mut closer_num_chars = closer.inl.data.borrow().value.text().unwrap().len();
+    pub fn insert_emph(&mut self, opener: usize, closer: usize) -> Option<usize> {
+        let opener_inl = self.delimiters[opener].inl;
+        let closer_inl = self.delimiters[closer].inl;
+        let opener_char = opener_inl.data.borrow().value.text().unwrap()[0];
+        let mut opener_num_chars = opener_inl.data.borrow().value.text().unwrap().len();
+        let mut closer_num_chars = closer_inl.data.borrow().value.text().unwrap().len();
         let use_delims = if closer_num_chars >= 2 && opener_num_chars >= 2 {
             2
         } else {
@@ -743,16 +866,14 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
             return None;
         }
 
-        opener
-            .inl
+        opener_inl
             .data
             .borrow_mut()
             .value
             .text_mut()
             .unwrap()
             .truncate(opener_num_chars);
-        closer
-            .inl
+        closer_inl
             .data
             .borrow_mut()
             .value
@@ -762,10 +883,13 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
 
         // Remove all the candidate delimiters from between the opener and the
         // closer. None of them are matched pairs. They've been scanned already.
-        let mut delim = closer.prev.get();
-        while delim.is_some() && !Self::del_ref_eq(delim, Some(opener)) {
-            self.remove_delimiter(delim.unwrap());
-            delim = delim.unwrap().prev.get();
+        let mut delim = self.delimiters[closer].prev;
+        while let Some(d) = delim {
+            if d == opener {
+                break;
+            }
+            self.remove_delimiter(d);
+            delim = self.delimiters[d].prev;
         }
 
         let emph = make_inline(
@@ -783,8 +907,8 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
 
         // Drop all the interior AST nodes into the emphasis node
         // and then insert the emphasis node
-        let mut tmp = opener.inl.next_sibling().unwrap();
-        while !tmp.same_node(closer.inl) {
+        let mut tmp = opener_inl.next_sibling().unwrap();
+        while !tmp.same_node(closer_inl) {
             let next = tmp.next_sibling();
             emph.append(tmp);
             if let Some(n) = next {
@@ -793,34 +917,35 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 break;
             }
         }
-        opener.inl.insert_after(emph);
+        opener_inl.insert_after(emph);
 
         // Drop the delimiters and return the next closer to process
 
         if opener_num_chars == 0 {
-            opener.inl.detach();
+            opener_inl.detach();
             self.remove_delimiter(opener);
         }
 
         if closer_num_chars == 0 {
-            closer.inl.detach();
+            closer_inl.detach();
             self.remove_delimiter(closer);
-            closer.next.get()
+            self.delimiters[closer].next
         } else {
             Some(closer)
         }
     }
 
-    pub fn handle_backslash(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_backslash(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         self.pos += 1;
         if self.peek_char().map_or(false, |&c| ispunct(c)) {
             self.pos += 1;
-            // TODO
-            make_inline(self.arena, NodeValue::Text(vec![self.input[self.pos - 1]]))
+            self.push_text(node, &self.input[self.pos - 1..self.pos]);
+            None
         } else if !self.eof() && self.skip_line_end() {
-            make_inline(self.arena, NodeValue::LineBreak)
+            Some(make_inline(self.arena, NodeValue::LineBreak))
         } else {
-            make_inline(self.arena, NodeValue::Text(b"\\".to_vec()))
+            self.push_text(node, b"\\");
+            None
         }
     }
 
@@ -835,19 +960,20 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         self.pos > old_pos || self.eof()
     }
 
-    pub fn handle_entity(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_entity(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         self.pos += 1;
 
         match entity::unescape(&self.input[self.pos..]) {
-            None => make_inline(self.arena, NodeValue::Text(b"&".to_vec())),
+            None => self.push_text(node, b"&"),
             Some((entity, len)) => {
                 self.pos += len;
-                make_inline(self.arena, NodeValue::Text(entity))
+                self.push_text(node, &entity);
             }
         }
+        None
     }
 
-    pub fn handle_pointy_brace(&mut self) -> &'a AstNode<'a> {
+    pub fn handle_pointy_brace(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         self.pos += 1;
 
         if let Some(matchlen) = scanners::autolink_uri(&self.input[self.pos..]) {
@@ -857,7 +983,7 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 AutolinkType::URI,
             );
             self.pos += matchlen;
-            return inl;
+            return Some(inl);
         }
 
         if let Some(matchlen) = scanners::autolink_email(&self.input[self.pos..]) {
@@ -867,17 +993,18 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
                 AutolinkType::Email,
             );
             self.pos += matchlen;
-            return inl;
+            return Some(inl);
         }
 
         if let Some(matchlen) = scanners::html_tag(&self.input[self.pos..]) {
             let contents = &self.input[self.pos - 1..self.pos + matchlen];
             let inl = make_inline(self.arena, NodeValue::HtmlInline(contents.to_vec()));
             self.pos += matchlen;
-            return inl;
+            return Some(inl);
         }
 
-        make_inline(self.arena, NodeValue::Text(b"<".to_vec()))
+        self.push_text(node, b"<");
+        None
     }
 
     pub fn push_bracket(&mut self, image: bool, inl_text: &'a AstNode<'a>) {
@@ -895,18 +1022,20 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         });
     }
 
-    pub fn handle_close_bracket(&mut self) -> Option<&'a AstNode<'a>> {
+    pub fn handle_close_bracket(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
         self.pos += 1;
         let initial_pos = self.pos;
 
         let brackets_len = self.brackets.len();
         if brackets_len == 0 {
-            return Some(make_inline(self.arena, NodeValue::Text(b"]".to_vec())));
+            self.push_text(node, b"]");
+            return None;
         }
 
         if !self.brackets[brackets_len - 1].active {
             self.brackets.pop();
-            return Some(make_inline(self.arena, NodeValue::Text(b"]".to_vec())));
+            self.push_text(node, b"]");
+            return None;
         }
 
         let is_image = self.brackets[brackets_len - 1].image;
@@ -937,8 +1066,8 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
 
             if endall < self.input.len() && self.input[endall] == b')' {
                 self.pos = endall + 1;
-                let url = strings::clean_url(url);
-                let title = strings::clean_title(&self.input[starttitle..endtitle]);
+                let url = strings::clean_url(url).into_owned();
+                let title = strings::clean_title(&self.input[starttitle..endtitle]).into_owned();
                 self.close_bracket_match(is_image, url, title);
                 return None;
             } else {
@@ -948,37 +1077,57 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
 
         // Try to see if this is a reference link
 
-        let (mut lab, mut found_label) = match self.link_label() {
-            Some(lab) => (lab.to_vec(), true),
-            None => (vec![], false),
+        let (mut lab, mut found_label) = match self.link_label_range() {
+            Some(range) => (range, true),
+            None => ((0, 0), false),
         };
 
         if !found_label {
             self.pos = initial_pos;
         }
 
-        if (!found_label || lab.is_empty()) && !self.brackets[brackets_len - 1].bracket_after {
-            lab = self.input[self.brackets[brackets_len - 1].position..initial_pos - 1].to_vec();
+        if (!found_label || lab.0 == lab.1) && !self.brackets[brackets_len - 1].bracket_after {
+            lab = (self.brackets[brackets_len - 1].position, initial_pos - 1);
             found_label = true;
         }
 
         // Need to normalize both to lookup in refmap and to call callback
-        lab = strings::normalize_label(&lab);
+        if found_label {
+            strings::normalize_label_into(&self.input[lab.0..lab.1], &mut self.label);
+        } else {
+            self.label.clear();
+        }
         let mut reff = if found_label {
-            self.refmap.get(&lab).cloned()
+            let shared = self.options.parse.reference_definitions.as_ref();
+            self.refmap
+                .get(&self.label)
+                .or_else(|| shared.and_then(|defs| defs.get(&self.label)))
+                .map(|r| (r.url.clone(), r.title.clone()))
         } else {
             None
         };
 
         // Attempt to use the provided broken link callback if a reference cannot be resolved
         if reff.is_none() {
-            if let Some(ref mut callback) = self.callback {
-                reff = callback(&lab).map(|(url, title)| Reference { url, title });
-            }
+            reff = match self
+                .broken_links
+                .and_then(|results| results.get(&self.label))
+            {
+                Some(result) => result.clone(),
+                None => match self.callback {
+                    Some(ref mut callback) => callback(&self.label),
+                    None => {
+                        if let Some(ref mut labels) = self.broken_labels {
+                            labels.push(self.label.clone());
+                        }
+                        None
+                    }
+                },
+            };
         }
 
-        if let Some(reff) = reff {
-            self.close_bracket_match(is_image, reff.url.clone(), reff.title);
+        if let Some((url, title)) = reff {
+            self.close_bracket_match(is_image, url, title);
             return None;
         }
 
@@ -994,7 +1143,7 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         {
             let text = text.unwrap();
             if text.len() > 1 && text[0] == b'^' {
-                let inl = make_inline(self.arena, NodeValue::FootnoteReference(text[1..].to_vec()));
+                let inl = self.make_footnote_reference(node, &text[1..]);
                 self.brackets[brackets_len - 1].inl_text.insert_before(inl);
                 self.brackets[brackets_len - 1]
                     .inl_text
@@ -1011,7 +1160,39 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
 
         self.brackets.pop();
         self.pos = initial_pos;
-        Some(make_inline(self.arena, NodeValue::Text(b"]".to_vec())))
+        self.push_text(node, b"]");
+        None
+    }
+
+    // References within a footnote definition are left as they are. Others
+    // are numbered in order of first reference, or turned back into text if
+    // there's no such footnote.
+    fn make_footnote_reference(&mut self, node: &'a AstNode<'a>, name: &[u8]) -> &'a AstNode<'a> {
+        let in_definition = node.ancestors().any(|n| match n.data.borrow().value {
+            NodeValue::FootnoteDefinition(..) => true,
+            _ => false,
+        });
+        if in_definition {
+            return make_inline(self.arena, NodeValue::FootnoteReference(name.to_vec()));
+        }
+
+        match self.footnotes.get_mut(name) {
+            Some(number) => {
+                if number.is_none() {
+                    self.footnote_ix += 1;
+                    *number = Some(self.footnote_ix);
+                }
+                let ix = format!("{}", number.unwrap()).into_bytes();
+                make_inline(self.arena, NodeValue::FootnoteReference(ix))
+            }
+            None => {
+                let mut label = Vec::with_capacity(name.len() + 3);
+                label.extend_from_slice(b"[^");
+                label.extend_from_slice(name);
+                label.push(b']');
+                make_inline(self.arena, NodeValue::Text(label))
+            }
+        }
     }
 
     pub fn close_bracket_match(&mut self, is_image: bool, url: Vec<u8>, title: Vec<u8>) {
@@ -1054,6 +1235,15 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
     }
 
     pub fn link_label(&mut self) -> Option<&[u8]> {
+        match self.link_label_range() {
+            Some((start, end)) => Some(&self.input[start..end]),
+            None => None,
+        }
+    }
+
+    // As `link_label`, but returns the position of the trimmed label within
+    // `input`.
+    fn link_label_range(&mut self) -> Option<(usize, usize)> {
         let startpos = self.pos;
 
         if self.peek_char() != Some(&(b'[')) {
@@ -1083,9 +1273,11 @@ impl<'a, 'r, 'o, 'd, 'i, 'c, 'subj> Subject<'a, 'r, 'o, 'd, 'i, 'c, 'subj> {
         }
 
         if c == b']' {
-            let raw_label = strings::trim_slice(&self.input[startpos + 1..self.pos]);
+            let raw_label = &self.input[startpos + 1..self.pos];
+            let trimmed = strings::trim_slice(raw_label);
+            let start = startpos + 1 + strings::rtrim_slice(raw_label).len() - trimmed.len();
             self.pos += 1;
-            Some(raw_label)
+            Some((start, start + trimmed.len()))
         } else {
             self.pos = startpos;
             None
@@ -1186,13 +1378,13 @@ fn make_autolink<'a>(
     let inl = make_inline(
         arena,
         NodeValue::Link(NodeLink {
-            url: strings::clean_autolink(url, kind),
+            url: strings::clean_autolink(url, kind).into_owned(),
             title: vec![],
         }),
     );
     inl.append(make_inline(
         arena,
-        NodeValue::Text(entity::unescape_html(url)),
+        NodeValue::Text(entity::unescape_html(url).into_owned()),
     ));
     inl
 }
@@ -2,21 +2,26 @@ mod autolink;
 mod inlines;
 mod table;
 
+use adapters::SyntaxHighlighterAdapter;
 use arena_tree::Node;
 use ctype::{isdigit, isspace};
-use entity;
+use html::UrlSchemeFilter;
 use nodes;
 use nodes::{
     Ast, AstNode, ListDelimType, ListType, NodeCodeBlock, NodeDescriptionItem, NodeHeading,
-    NodeHtmlBlock, NodeList, NodeValue,
+    NodeHtmlBlock, NodeList, NodeValue, TableAlignment,
 };
-use regex::bytes::{Regex, RegexBuilder};
+use rustc_hash::{FxHashMap, FxHashSet};
+use sanitizer::HtmlSanitizer;
 use scanners;
 use std::cell::RefCell;
 use std::cmp::min;
-use std::collections::HashMap;
+use std::collections::VecDeque;
+use std::fmt;
+use std::io;
 use std::mem;
 use std::str;
+use std::sync::Arc;
 use strings;
 use typed_arena::Arena;
 
@@ -50,6 +55,10 @@ pub fn parse_document<'a>(
 /// **Note:** The label provided to the callback is the normalized representation of the label as
 /// described in the [GFM spec](https://github.github.com/gfm/#matches).
 ///
+/// The callback is called for every broken reference, even one whose label has been seen before.
+/// To call it only once per distinct label, within a document or across documents, wrap it in a
+/// [`BrokenLinkCache`](struct.BrokenLinkCache.html).
+///
 /// ```
 /// extern crate comrak;
 /// use comrak::{Arena, parse_document_with_broken_link_callback, format_html, ComrakOptions};
@@ -87,23 +96,466 @@ pub fn parse_document_with_broken_link_callback<'a, 'c>(
     options: &ComrakOptions,
     callback: Option<Callback<'c>>,
 ) -> &'a AstNode<'a> {
-    let root: &'a AstNode<'a> = arena.alloc(Node::new(RefCell::new(Ast {
+    let root = make_document(arena);
+    let mut parser = Parser::new(arena, root, options, callback);
+    parser.feed(buffer);
+    parser.finish()
+}
+
+/// Parse several Markdown documents to ASTs, resolving their broken references in one batch.
+///
+/// This is like [`parse_document_with_broken_link_callback`](fn.parse_document_with_broken_link_callback.html),
+/// except that rather than being called as each broken reference is found, `callback` is called
+/// once, with the distinct normalized labels of the broken references in all of `buffers`.  It
+/// returns the destination and title for each label, in the same order, or `None` where it's
+/// still broken; labels past the end of the returned `Vec` are taken to be broken.  It isn't
+/// called at all if no reference is broken.
+///
+/// Each block in which a reference is resolved is then parsed again, so the ASTs are just as if
+/// a callback had given the same answers as each reference was found.
+///
+/// ```
+/// # use comrak::{Arena, format_html, parse_documents_with_broken_link_batch, ComrakOptions};
+/// let arena = Arena::new();
+/// let options = ComrakOptions::default();
+/// let mut batches = vec![];
+///
+/// let roots = parse_documents_with_broken_link_batch(
+///     &arena,
+///     &["See [Home] and [elsewhere].\n", "Back [home].\n"],
+///     &options,
+///     &mut |labels: &[Vec<u8>]| {
+///         batches.push(labels.to_vec());
+///         labels
+///             .iter()
+///             .map(|label| match &label[..] {
+///                 b"home" => Some((b"/".to_vec(), vec![])),
+///                 _ => None,
+///             })
+///             .collect()
+///     },
+/// );
+/// assert_eq!(batches, vec![vec![b"home".to_vec(), b"elsewhere".to_vec()]]);
+///
+/// let mut html = vec![];
+/// for root in roots {
+///     format_html(root, &options, &mut html).unwrap();
+/// }
+/// assert_eq!(
+///     String::from_utf8(html).unwrap(),
+///     "<p>See <a href=\"/\">Home</a> and [elsewhere].</p>\n<p>Back <a href=\"/\">home</a>.</p>\n"
+/// );
+/// ```
+pub fn parse_documents_with_broken_link_batch<'a, 'c>(
+    arena: &'a Arena<AstNode<'a>>,
+    buffers: &[&str],
+    options: &ComrakOptions,
+    callback: BatchCallback<'c>,
+) -> Vec<&'a AstNode<'a>> {
+    let mut documents = Vec::with_capacity(buffers.len());
+    for buffer in buffers {
+        let root = make_document(arena);
+        let mut parser = Parser::new(arena, root, options, None);
+        parser.feed(buffer);
+        parser.finalize_document();
+        let inlines = parser.parse_document_inlines(true);
+        documents.push((parser, inlines));
+    }
+
+    // A resolved link can change how the rest of its block parses, so parsing
+    // a block again can turn up labels that weren't in the batch; those are
+    // resolved in another.
+    let mut resolved = FxHashMap::default();
+    loop {
+        let mut labels = vec![];
+        let mut seen = FxHashSet::default();
+        for &(_, ref inlines) in &documents {
+            for block in &inlines.deferred {
+                for label in &block.labels {
+                    if !resolved.contains_key(label) && seen.insert(label) {
+                        labels.push(label.clone());
+                    }
+                }
+            }
+        }
+        if labels.is_empty() {
+            break;
+        }
+
+        let mut results = callback(&labels).into_iter();
+        for label in labels {
+            resolved.insert(label, results.next().unwrap_or(None));
+        }
+        for &mut (ref mut parser, ref mut inlines) in &mut documents {
+            parser.reparse_deferred_inlines(inlines, &resolved);
+        }
+    }
+
+    documents
+        .into_iter()
+        .map(|(mut parser, inlines)| {
+            parser.finish_document_inlines(inlines);
+            parser.root
+        })
+        .collect()
+}
+
+// Returns the length of the front matter at the start of `s`: a line consisting
+// of `delimiter` (optionally preceded by a byte order mark), through the next
+// line consisting of `delimiter`.  Only walks as far as that closing line.
+fn scan_front_matter(s: &[u8], delimiter: &[u8]) -> Option<usize> {
+    let start = if s.starts_with(b"\xEF\xBB\xBF") { 3 } else { 0 };
+    let mut i = delimiter_line_end(s, start, delimiter)?;
+
+    loop {
+        if let Some(end) = delimiter_line_end(s, i, delimiter) {
+            return Some(end);
+        }
+        i += s[i..].iter().position(|&c| c == b'\n')? + 1;
+    }
+}
+
+fn delimiter_line_end(s: &[u8], i: usize, delimiter: &[u8]) -> Option<usize> {
+    if !s[i..].starts_with(delimiter) {
+        return None;
+    }
+
+    let mut end = i + delimiter.len();
+    if s.get(end) == Some(&b'\r') {
+        end += 1;
+    }
+    if s.get(end) == Some(&b'\n') {
+        Some(end + 1)
+    } else {
+        None
+    }
+}
+
+/// Parse a Markdown document to an AST, stopping as soon as the caller has seen enough.
+///
+/// `done` is called with each top-level block in turn as soon as it is complete, with its inlines
+/// already parsed.  Once it returns `true`, no more of `buffer` is read, and the returned document
+/// holds only that block and those before it.  If it never does, the whole document is parsed.
+///
+/// Since the rest of the document isn't read, inlines are parsed only against the link reference
+/// definitions that come before the block (and any in
+/// [`ComrakParseOptions::reference_definitions`](struct.ComrakParseOptions.html#structfield.reference_definitions)),
+/// and footnote references are left as text.
+///
+/// ```
+/// # use comrak::{Arena, parse_document_until, ComrakOptions};
+/// use comrak::nodes::{NodeHeading, NodeValue};
+/// let arena = Arena::new();
+/// let mut seen = 0;
+/// let root = parse_document_until(
+///     &arena,
+///     "Intro.\n\n# Title\n\nLots more text.\n\n# And more headings\n",
+///     &ComrakOptions::default(),
+///     |node| {
+///         seen += 1;
+///         match node.data.borrow().value {
+///             NodeValue::Heading(NodeHeading { level: 1, .. }) => true,
+///             _ => false,
+///         }
+///     },
+/// );
+/// assert_eq!(seen, 2);
+/// assert_eq!(root.children().count(), 2);
+/// ```
+pub fn parse_document_until<'a, F>(
+    arena: &'a Arena<AstNode<'a>>,
+    buffer: &str,
+    options: &ComrakOptions,
+    mut done: F,
+) -> &'a AstNode<'a>
+where
+    F: FnMut(&'a AstNode<'a>) -> bool,
+{
+    let root = make_document(arena);
+    let mut parser = Parser::new(arena, root, options, None);
+    let mut delivered = None;
+
+    let stopped = parser.feed_until(buffer, |parser| {
+        parser.deliver_closed_blocks(&mut delivered, &mut done)
+    });
+    if stopped {
+        // Blocks opened by the line that closed the last one delivered.
+        while let Some(node) = delivered.and_then(|node| node.next_sibling()) {
+            node.detach();
+        }
+    } else {
+        parser.finalize_document();
+        parser.deliver_closed_blocks(&mut delivered, &mut done);
+    }
+
+    root
+}
+
+// Receives a document from `parse_streaming` a top-level block at a time.
+pub trait StreamSink<'a> {
+    // A complete top-level block other than a table.
+    fn block(&mut self, node: &'a AstNode<'a>) -> io::Result<()>;
+
+    // A top-level table, holding only its header row.
+    fn table_start(&mut self, table: &'a AstNode<'a>) -> io::Result<()>;
+
+    // A body row of the table last started.  The row's parent is a copy of the
+    // table node, and both are dropped once this returns.
+    fn table_row<'b>(&mut self, row: &'b AstNode<'b>) -> io::Result<()>;
+
+    // The end of the table last started.
+    fn table_end(&mut self, table: &'a AstNode<'a>) -> io::Result<()>;
+}
+
+// Parses `buffer`, handing each top-level block to `sink` as soon as it's
+// complete.  Body rows of top-level tables are never added to the tree, but
+// handed over one at a time.  As with `parse_document_until`, inlines only see
+// the link reference and footnote definitions before them.  The footnotes
+// referenced are handed over last, as blocks.
+pub fn parse_streaming<'a, S>(
+    arena: &'a Arena<AstNode<'a>>,
+    buffer: &str,
+    options: &ComrakOptions,
+    sink: &mut S,
+) -> io::Result<()>
+where
+    S: StreamSink<'a>,
+{
+    let root = make_document(arena);
+    let mut parser = Parser::new(arena, root, options, None);
+    parser.stream_table_rows = true;
+    let mut state = StreamState {
+        delivered: None,
+        table_started: false,
+        alignments: vec![],
+        footnotes: FxHashMap::default(),
+        numbers: FxHashMap::default(),
+        footnote_ix: 0,
+        definitions_seen: 0,
+    };
+    let mut result = Ok(());
+
+    let stopped = parser.feed_until(buffer, |parser| {
+        result = parser.stream_closed_blocks(&mut state, sink);
+        result.is_err()
+    });
+    if stopped {
+        return result;
+    }
+
+    parser.finalize_document();
+    parser.stream_closed_blocks(&mut state, sink)?;
+    for node in Parser::number_footnotes(state.footnotes, &state.numbers) {
+        root.append(node);
+        sink.block(node)?;
+    }
+    Ok(())
+}
+
+// What `parse_streaming` has handed over so far.
+struct StreamState<'a> {
+    // The last top-level block handed over.
+    delivered: Option<&'a AstNode<'a>>,
+    // Whether the table after `delivered` has been started.
+    table_started: bool,
+    // The alignments of that table, lent to each of its rows in turn.
+    alignments: Vec<TableAlignment>,
+    // The footnote definitions seen so far, their numbers if they've been
+    // referenced, and how many have been referenced.
+    footnotes: FxHashMap<Vec<u8>, &'a AstNode<'a>>,
+    numbers: FxHashMap<Vec<u8>, Option<u32>>,
+    footnote_ix: u32,
+    // How many of the parser's footnote definitions have been seen.
+    definitions_seen: usize,
+}
+
+fn make_document<'a>(arena: &'a Arena<AstNode<'a>>) -> &'a AstNode<'a> {
+    arena.alloc(Node::new(RefCell::new(Ast {
         value: NodeValue::Document,
         content: vec![],
         start_line: 0,
         open: true,
         last_line_blank: false,
-    })));
-    let mut parser = Parser::new(arena, root, options, callback);
-    parser.feed(buffer);
-    parser.finish()
+    })))
+}
+
+/// A set of link reference definitions, parsed once and then shared by any number of documents
+/// through [`ComrakParseOptions::reference_definitions`](struct.ComrakParseOptions.html#structfield.reference_definitions).
+///
+/// A document's own definitions take precedence over these, and these take precedence over the
+/// broken link callback.
+///
+/// ```
+/// # use comrak::{markdown_to_html, ComrakOptions, ReferenceDefinitions};
+/// # use std::sync::Arc;
+/// let mut options = ComrakOptions::default();
+/// let defs = ReferenceDefinitions::parse("[home]: /index.html\n[wiki]: /wiki \"Wiki\"\n", &options);
+/// assert_eq!(defs.len(), 2);
+///
+/// options.parse.reference_definitions = Some(Arc::new(defs));
+/// assert_eq!(markdown_to_html("[Home] and [the wiki][wiki]\n", &options),
+///            "<p><a href=\"/index.html\">Home</a> and <a href=\"/wiki\" title=\"Wiki\">the wiki</a></p>\n");
+/// ```
+#[derive(Default, Debug, Clone)]
+pub struct ReferenceDefinitions {
+    refmap: FxHashMap<Vec<u8>, Reference>,
+}
+
+impl ReferenceDefinitions {
+    /// Collects the link reference definitions in `buffer`. Everything else in it is parsed as
+    /// usual for block structure, and then discarded.
+    pub fn parse(buffer: &str, options: &ComrakOptions) -> Self {
+        let arena = Arena::new();
+        let root = make_document(&arena);
+        let mut parser = Parser::new(&arena, root, options, None);
+        parser.feed(buffer);
+        parser.finalize_document();
+        ReferenceDefinitions {
+            refmap: parser.refmap,
+        }
+    }
+
+    /// The number of definitions.
+    pub fn len(&self) -> usize {
+        self.refmap.len()
+    }
+
+    /// Whether there are no definitions.
+    pub fn is_empty(&self) -> bool {
+        self.refmap.is_empty()
+    }
+
+    pub(crate) fn get(&self, label: &[u8]) -> Option<&Reference> {
+        self.refmap.get(label)
+    }
+}
+
+/// Remembers the results of a broken link callback, so that an expensive lookup is done once per
+/// label rather than once per reference.  Negative results are remembered too.  Once `capacity`
+/// labels are held, the oldest is forgotten to make room.
+///
+/// Keep one for a single document to memoize within it, or across many to share results between
+/// them.
+///
+/// ```
+/// # use comrak::{Arena, parse_document_with_broken_link_callback, ComrakOptions, BrokenLinkCache};
+/// let mut lookups = 0;
+/// let mut cache = BrokenLinkCache::new(
+///     |label: &[u8]| {
+///         lookups += 1;
+///         if label == b"home" {
+///             Some((b"/".to_vec(), vec![]))
+///         } else {
+///             None
+///         }
+///     },
+///     100,
+/// );
+///
+/// let options = ComrakOptions::default();
+/// for doc in &["[home] [missing]", "[Home] [missing] [home]"] {
+///     let arena = Arena::new();
+///     parse_document_with_broken_link_callback(
+///         &arena,
+///         doc,
+///         &options,
+///         Some(&mut |label: &[u8]| cache.resolve(label)),
+///     );
+/// }
+/// drop(cache);
+/// assert_eq!(lookups, 2);
+/// ```
+pub struct BrokenLinkCache<F> {
+    callback: F,
+    capacity: usize,
+    entries: FxHashMap<Vec<u8>, Option<(Vec<u8>, Vec<u8>)>>,
+    order: VecDeque<Vec<u8>>,
+}
+
+impl<F> BrokenLinkCache<F>
+where
+    F: FnMut(&[u8]) -> Option<(Vec<u8>, Vec<u8>)>,
+{
+    /// Wraps `callback`, remembering results for up to `capacity` labels.
+    pub fn new(callback: F, capacity: usize) -> Self {
+        BrokenLinkCache {
+            callback,
+            capacity,
+            entries: FxHashMap::default(),
+            order: VecDeque::new(),
+        }
+    }
+
+    /// Returns the remembered result for the normalized `label`, calling the wrapped callback
+    /// if there is none.
+    pub fn resolve(&mut self, label: &[u8]) -> Option<(Vec<u8>, Vec<u8>)> {
+        if let Some(result) = self.entries.get(label) {
+            return result.clone();
+        }
+
+        let result = (self.callback)(label);
+        if self.capacity > 0 {
+            if self.entries.len() >= self.capacity {
+                if let Some(oldest) = self.order.pop_front() {
+                    self.entries.remove(&oldest);
+                }
+            }
+            self.entries.insert(label.to_vec(), result.clone());
+            self.order.push_back(label.to_vec());
+        }
+        result
+    }
+
+    /// The number of labels currently remembered.
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Whether no labels are currently remembered.
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Forgets all remembered results.
+    pub fn clear(&mut self) {
+        self.entries.clear();
+        self.order.clear();
+    }
+}
+
+impl<F> fmt::Debug for BrokenLinkCache<F> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("BrokenLinkCache")
+            .field("capacity", &self.capacity)
+            .field("len", &self.entries.len())
+            .finish()
+    }
 }
 
 type Callback<'c> = &'c mut dyn FnMut(&[u8]) -> Option<(Vec<u8>, Vec<u8>)>;
 
+type BatchCallback<'c> = &'c mut dyn FnMut(&[Vec<u8>]) -> Vec<Option<(Vec<u8>, Vec<u8>)>>;
+
+// A document's state between parsing its inlines and numbering its footnotes.
+struct DocumentInlines<'a> {
+    definitions: FxHashMap<Vec<u8>, &'a AstNode<'a>>,
+    numbers: FxHashMap<Vec<u8>, Option<u32>>,
+    footnote_ix: u32,
+    deferred: Vec<DeferredBlock<'a>>,
+    reparsed: bool,
+}
+
+// A block whose broken links were left unresolved: the labels of those links,
+// and the block's content, to parse it from again once they're resolved.
+struct DeferredBlock<'a> {
+    node: &'a AstNode<'a>,
+    content: Vec<u8>,
+    labels: Vec<Vec<u8>>,
+}
+
 pub struct Parser<'a, 'o, 'c> {
     arena: &'a Arena<AstNode<'a>>,
-    refmap: HashMap<Vec<u8>, Reference>,
+    refmap: FxHashMap<Vec<u8>, Reference>,
     root: &'a AstNode<'a>,
     current: &'a AstNode<'a>,
     line_number: u32,
@@ -115,8 +567,20 @@ pub struct Parser<'a, 'o, 'c> {
     blank: bool,
     partially_consumed_tab: bool,
     last_line_length: usize,
+    thematic_break_kill_pos: usize,
+    // The current line tokenized as a table row, when it continues an open
+    // table, for `table::try_opening_block` to use.
+    table_row: Option<table::Row>,
+    // Whether rows of top-level tables are collected in `streamed_rows`
+    // rather than added to the tree; see `parse_streaming`.
+    stream_table_rows: bool,
+    streamed_rows: Vec<Vec<Vec<u8>>>,
+    // What the last inline subject left to be reused by the next; see
+    // `inlines::Scratch`.
+    inline_scratch: Option<inlines::Scratch>,
     options: &'o ComrakOptions,
     callback: Option<Callback<'c>>,
+    footnote_definitions: Vec<&'a AstNode<'a>>,
 }
 
 #[derive(Default, Debug, Clone)]
@@ -338,6 +802,23 @@ pub struct ComrakParseOptions {
     ///            "<pre><code class=\"language-rust\">fn hello();\n</code></pre>\n");
     /// ```
     pub default_info_string: Option<String>,
+
+    /// Link reference definitions to use in addition to those in the document itself.
+    /// See [`ReferenceDefinitions`](struct.ReferenceDefinitions.html).
+    ///
+    /// ```
+    /// # use comrak::{markdown_to_html, ComrakOptions, ReferenceDefinitions};
+    /// # use std::sync::Arc;
+    /// let mut options = ComrakOptions::default();
+    /// assert_eq!(markdown_to_html("[comrak]\n", &options),
+    ///            "<p>[comrak]</p>\n");
+    ///
+    /// let defs = ReferenceDefinitions::parse("[comrak]: https://github.com/kivikakk/comrak\n", &options);
+    /// options.parse.reference_definitions = Some(Arc::new(defs));
+    /// assert_eq!(markdown_to_html("[comrak]\n", &options),
+    ///            "<p><a href=\"https://github.com/kivikakk/comrak\">comrak</a></p>\n");
+    /// ```
+    pub reference_definitions: Option<Arc<ReferenceDefinitions>>,
 }
 
 #[derive(Default, Debug, Clone, Copy)]
@@ -437,17 +918,60 @@ pub struct ComrakRenderOptions {
     pub escape: bool,
 }
 
-#[derive(Clone)]
+#[derive(Default, Debug)]
+/// Umbrella plugins struct.
+pub struct ComrakPlugins<'p> {
+    /// Configure render-time plugins.
+    pub render: ComrakRenderPlugins<'p>,
+}
+
+#[derive(Default)]
+/// Plugins for alternative rendering.
+pub struct ComrakRenderPlugins<'p> {
+    /// Provide a syntax highlighter adapter implementation for syntax
+    /// highlighting of code blocks.
+    ///
+    /// See [`SyntaxHighlighterAdapter`](adapters/trait.SyntaxHighlighterAdapter.html) for an
+    /// example.
+    pub codefence_syntax_highlighter: Option<&'p dyn SyntaxHighlighterAdapter>,
+
+    /// Sanitize raw HTML against an allowlist of tags and attributes as it's rendered, rather
+    /// than passing it through or omitting it.  This takes precedence over
+    /// [`ComrakRenderOptions::unsafe_`](struct.ComrakRenderOptions.html#structfield.unsafe_)
+    /// and the tagfilter extension, but not over
+    /// [`ComrakRenderOptions::escape`](struct.ComrakRenderOptions.html#structfield.escape).
+    ///
+    /// See [`HtmlSanitizer`](struct.HtmlSanitizer.html) for an example.
+    pub html_sanitizer: Option<&'p HtmlSanitizer>,
+
+    /// Decide which URL schemes links, images and sanitized HTML may use, in place of the
+    /// built-in rules alone.
+    ///
+    /// See [`UrlSchemeFilter`](struct.UrlSchemeFilter.html) for an example.
+    pub url_scheme_filter: Option<&'p UrlSchemeFilter>,
+}
+
+impl<'p> fmt::Debug for ComrakRenderPlugins<'p> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.debug_struct("ComrakRenderPlugins")
+            .field(
+                "codefence_syntax_highlighter",
+                &self
+                    .codefence_syntax_highlighter
+                    .map(|_| "impl SyntaxHighlighterAdapter"),
+            )
+            .field("html_sanitizer", &self.html_sanitizer)
+            .field("url_scheme_filter", &self.url_scheme_filter)
+            .finish()
+    }
+}
+
+#[derive(Clone, Debug)]
 pub struct Reference {
     pub url: Vec<u8>,
     pub title: Vec<u8>,
 }
 
-struct FootnoteDefinition<'a> {
-    ix: Option<u32>,
-    node: &'a AstNode<'a>,
-}
-
 impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
     fn new(
         arena: &'a Arena<AstNode<'a>>,
@@ -457,7 +981,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
     ) -> Self {
         Parser {
             arena,
-            refmap: HashMap::new(),
+            refmap: FxHashMap::default(),
             root,
             current: root,
             line_number: 0,
@@ -469,25 +993,32 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
             blank: false,
             partially_consumed_tab: false,
             last_line_length: 0,
+            thematic_break_kill_pos: 0,
+            table_row: None,
+            stream_table_rows: false,
+            streamed_rows: vec![],
+            inline_scratch: None,
             options,
             callback,
+            footnote_definitions: vec![],
         }
     }
 
     fn feed(&mut self, s: &str) {
+        self.feed_until(s, |_| false);
+    }
+
+    // As `feed`, but stops reading lines as soon as `stop` returns true after
+    // one.  Returns whether it stopped early.
+    fn feed_until<F>(&mut self, s: &str, mut stop: F) -> bool
+    where
+        F: FnMut(&mut Self) -> bool,
+    {
         let mut i = 0;
         let s = s.as_bytes();
 
         if let Some(ref delimiter) = self.options.extension.front_matter_delimiter {
-            let front_matter_pattern = RegexBuilder::new(&format!(
-                "\\A(?:\u{feff})?{delim}\\r?\\n.*^{delim}\\r?\\n(?:\\r?\\n)?",
-                delim = regex::escape(delimiter)
-            ))
-            .multi_line(true)
-            .dot_matches_new_line(true)
-            .build()
-            .unwrap();
-            if let Some(front_matter_size) = front_matter_pattern.shortest_match(s) {
+            if let Some(front_matter_size) = scan_front_matter(s, delimiter.as_bytes()) {
                 i += front_matter_size;
                 let node = self.add_child(self.root, NodeValue::FrontMatter(s[..i].to_vec()));
                 self.finalize(node).unwrap();
@@ -529,6 +1060,10 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                 if i < sz && s[i] == b'\n' {
                     i += 1;
                 }
+
+                if stop(self) {
+                    return true;
+                }
             } else {
                 debug_assert!(eol < sz && s[eol] == b'\0');
                 linebuf.extend_from_slice(&s[i..eol]);
@@ -536,6 +1071,8 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                 i = eol + 1;
             }
         }
+
+        false
     }
 
     fn find_first_nonspace(&mut self, line: &[u8]) {
@@ -584,6 +1121,8 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         self.column = 0;
         self.blank = false;
         self.partially_consumed_tab = false;
+        self.thematic_break_kill_pos = 0;
+        self.table_row = None;
 
         if self.line_number == 0
             && line.len() >= 3
@@ -679,7 +1218,8 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                     }
                 }
                 NodeValue::Table(..) => {
-                    if !table::matches(&line[self.first_nonspace..]) {
+                    self.table_row = table::row(&line[self.first_nonspace..]);
+                    if self.table_row.is_none() {
                         return (false, container, should_continue);
                     }
                     continue;
@@ -808,10 +1348,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
             } else if !indented
                 && match (&container.data.borrow().value, all_matched) {
                     (&NodeValue::Paragraph, false) => false,
-                    _ => unwrap_into(
-                        scanners::thematic_break(&line[self.first_nonspace..]),
-                        &mut matched,
-                    ),
+                    _ => unwrap_into(self.scan_thematic_break(line), &mut matched),
                 }
             {
                 *container = self.add_child(*container, NodeValue::ThematicBreak);
@@ -829,6 +1366,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                 let offset = self.first_nonspace + matched - self.offset;
                 self.advance_offset(line, offset, false);
                 *container = self.add_child(*container, NodeValue::FootnoteDefinition(c.to_vec()));
+                self.footnote_definitions.push(*container);
             } else if !indented
                 && self.options.extension.description_lists
                 && line[self.first_nonspace] == b':'
@@ -924,6 +1462,28 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         }
     }
 
+    fn scan_thematic_break(&mut self, line: &[u8]) -> Option<usize> {
+        // A failed scan rules out every later start within the same run of
+        // marker characters and spaces, so each line is scanned at most once
+        // no matter how many list markers precede the break.
+        if self.thematic_break_kill_pos > self.first_nonspace {
+            return None;
+        }
+
+        let res = scanners::thematic_break(&line[self.first_nonspace..]);
+        if res.is_none() {
+            let c = line[self.first_nonspace];
+            if c == b'*' || c == b'-' || c == b'_' {
+                self.thematic_break_kill_pos = self.first_nonspace
+                    + line[self.first_nonspace..]
+                        .iter()
+                        .take_while(|&&b| b == c || b == b' ' || b == b'\t')
+                        .count();
+            }
+        }
+        res
+    }
+
     fn advance_offset(&mut self, line: &[u8], mut count: usize, columns: bool) {
         while count > 0 {
             match line[self.offset] {
@@ -1253,7 +1813,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
 
     fn finish(&mut self) -> &'a AstNode<'a> {
         self.finalize_document();
-        self.postprocess_text_nodes(self.root);
+        self.process_inlines();
         self.root
     }
 
@@ -1263,10 +1823,6 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         }
 
         self.finalize(self.root);
-        self.process_inlines();
-        if self.options.extension.footnotes {
-            self.process_footnotes();
-        }
     }
 
     fn finalize(&mut self, node: &'a AstNode<'a>) -> Option<&'a AstNode<'a>> {
@@ -1274,21 +1830,24 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
     }
 
     fn resolve_reference_link_definitions(&mut self, content: &mut Vec<u8>) -> bool {
-        let mut seeked = 0;
-        {
-            let mut pos = 0;
-            let mut seek: &[u8] = &*content;
-            while !seek.is_empty()
-                && seek[0] == b'['
-                && unwrap_into(self.parse_reference_inline(seek), &mut pos)
-            {
-                seek = &seek[pos..];
-                seeked += pos;
+        if content.first() == Some(&b'[') {
+            let mut subj = inlines::Subject::new(
+                self.arena,
+                self.options,
+                mem::replace(content, vec![]),
+                &mut self.refmap,
+                self.callback.as_mut(),
+            );
+
+            let mut seeked = 0;
+            while subj.peek_char() == Some(&b'[') && Self::parse_reference_inline(&mut subj) {
+                seeked = subj.pos;
             }
-        }
 
-        if seeked != 0 {
-            *content = content[seeked..].to_vec();
+            *content = subj.reset(vec![]);
+            if seeked != 0 {
+                content.drain(..seeked);
+            }
         }
 
         !strings::is_blank(content)
@@ -1326,9 +1885,8 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                     }
                     assert!(pos < content.len());
 
-                    let mut tmp = entity::unescape_html(&content[..pos]);
-                    strings::trim(&mut tmp);
-                    strings::unescape(&mut tmp);
+                    let info = strings::unescape_html_and_backslashes(&content[..pos]);
+                    let tmp = strings::trim_slice(&info);
                     if tmp.is_empty() {
                         ncb.info = self
                             .options
@@ -1337,7 +1895,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                             .as_ref()
                             .map_or(vec![], |s| s.as_bytes().to_vec());
                     } else {
-                        ncb.info = tmp;
+                        ncb.info = tmp.to_vec();
                     }
 
                     if content[pos] == b'\r' {
@@ -1366,8 +1924,10 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
 
                     let mut subch = item.first_child();
                     while let Some(subitem) = subch {
-                        if nodes::ends_with_blank_line(subitem)
-                            && (item.next_sibling().is_some() || subitem.next_sibling().is_some())
+                        // Check siblings first: ends_with_blank_line walks down
+                        // through nested lists, which is quadratic when deep.
+                        if (item.next_sibling().is_some() || subitem.next_sibling().is_some())
+                            && nodes::ends_with_blank_line(subitem)
                         {
                             nl.tight = false;
                             break;
@@ -1388,118 +1948,510 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         parent
     }
 
+    // Everything that happens after block parsing is done in one walk over
+    // the block tree: each leaf block has its inlines parsed and its text
+    // nodes post-processed in turn, and footnote references are resolved as
+    // they're parsed, against definitions recorded during block parsing.
     fn process_inlines(&mut self) {
-        self.process_inlines_node(self.root);
+        let inlines = self.parse_document_inlines(false);
+        self.finish_document_inlines(inlines);
+    }
+
+    // Parses the inlines of the whole document.  With `defer_broken_links`,
+    // broken links are left as text rather than passed to the callback, and
+    // the blocks they're in are kept to be parsed again by
+    // `reparse_deferred_inlines` once their labels are resolved.
+    fn parse_document_inlines(&mut self, defer_broken_links: bool) -> DocumentInlines<'a> {
+        let arena = self.arena;
+        let options = self.options;
+        let definitions = Self::collect_footnote_definitions(&self.footnote_definitions);
+        let mut deferred = vec![];
+        let mut subj = inlines::Subject::new(
+            arena,
+            options,
+            vec![],
+            &mut self.refmap,
+            self.callback.as_mut(),
+        );
+        if options.extension.footnotes {
+            subj.footnotes = definitions.keys().map(|k| (k.clone(), None)).collect();
+        }
+        if defer_broken_links {
+            subj.broken_labels = Some(vec![]);
+            Self::process_inlines_within(arena, options, &mut subj, self.root, Some(&mut deferred));
+        } else {
+            Self::process_inlines_within(arena, options, &mut subj, self.root, None);
+        }
+
+        DocumentInlines {
+            definitions,
+            numbers: mem::replace(&mut subj.footnotes, FxHashMap::default()),
+            footnote_ix: subj.footnote_ix,
+            deferred,
+            reparsed: false,
+        }
     }
 
-    fn process_inlines_node(&mut self, node: &'a AstNode<'a>) {
-        for node in node.descendants() {
-            if node.data.borrow().value.contains_inlines() {
-                self.parse_inlines(node);
+    // Parses again each deferred block in which a broken link has been
+    // resolved, given the `resolved` labels so far.  Blocks in which that
+    // turns up labels not yet resolved are deferred again, with just those
+    // labels.
+    fn reparse_deferred_inlines(
+        &mut self,
+        inlines: &mut DocumentInlines<'a>,
+        resolved: &FxHashMap<Vec<u8>, Option<(Vec<u8>, Vec<u8>)>>,
+    ) {
+        let arena = self.arena;
+        let options = self.options;
+        let mut subj = inlines::Subject::new(arena, options, vec![], &mut self.refmap, None);
+        subj.footnotes = mem::replace(&mut inlines.numbers, FxHashMap::default());
+        subj.footnote_ix = inlines.footnote_ix;
+        subj.broken_labels = Some(vec![]);
+        subj.broken_links = Some(resolved);
+
+        let mut deferred = vec![];
+        for block in mem::replace(&mut inlines.deferred, vec![]) {
+            let any_resolved = block.labels.iter().any(|label| match resolved.get(label) {
+                Some(&Some(_)) => true,
+                _ => false,
+            });
+            if !any_resolved {
+                continue;
+            }
+
+            let node = block.node;
+            while let Some(child) = node.first_child() {
+                child.detach();
             }
+            node.data.borrow_mut().content = block.content;
+            inlines.reparsed = true;
+            Self::process_inlines_within(arena, options, &mut subj, node, Some(&mut deferred));
         }
+
+        inlines.deferred = deferred;
+        inlines.numbers = mem::replace(&mut subj.footnotes, FxHashMap::default());
+        inlines.footnote_ix = subj.footnote_ix;
     }
 
-    fn parse_inlines(&mut self, node: &'a AstNode<'a>) {
-        let delimiter_arena = Arena::new();
-        let node_data = node.data.borrow();
-        let content = strings::rtrim_slice(&node_data.content);
-        let mut subj = inlines::Subject::new(
+    fn finish_document_inlines(&mut self, mut inlines: DocumentInlines<'a>) {
+        if self.options.extension.footnotes {
+            if inlines.reparsed {
+                self.renumber_footnote_references(&mut inlines);
+            }
+            self.process_footnotes(inlines.definitions, inlines.numbers, inlines.footnote_ix);
+        }
+    }
+
+    // Numbers the footnote references afresh in document order, since parsing
+    // blocks again can add or remove references, or change which comes first.
+    fn renumber_footnote_references(&self, inlines: &mut DocumentInlines<'a>) {
+        let names: FxHashMap<u32, Vec<u8>> = inlines
+            .numbers
+            .iter_mut()
+            .filter_map(|(name, number)| number.take().map(|n| (n, name.clone())))
+            .collect();
+        let mut ix = 0;
+        for node in self.root.descendants() {
+            if let NodeValue::FootnoteReference(ref mut r) = node.data.borrow_mut().value {
+                if Self::within_footnote_definition(node) {
+                    continue;
+                }
+                let name = str::from_utf8(r)
+                    .ok()
+                    .and_then(|r| r.parse().ok())
+                    .and_then(|n| names.get(&n))
+                    .unwrap();
+                let number = inlines.numbers.get_mut(name).unwrap();
+                if number.is_none() {
+                    ix += 1;
+                    *number = Some(ix);
+                }
+                *r = format!("{}", number.unwrap()).into_bytes();
+            }
+        }
+        inlines.footnote_ix = ix;
+    }
+
+    // Parses and post-processes the inlines of each leaf block in `top`'s
+    // subtree, `top` included.  With `deferred`, each block in which `subj`
+    // collects the labels of broken links is added to it, with those labels.
+    fn process_inlines_within<'r, 'subj>(
+        arena: &'a Arena<AstNode<'a>>,
+        options: &ComrakOptions,
+        subj: &mut inlines::Subject<'a, 'r, 'o, 'c, 'subj>,
+        top: &'a AstNode<'a>,
+        mut deferred: Option<&mut Vec<DeferredBlock<'a>>>,
+    ) {
+        let mut next = Some(top);
+        while let Some(node) = next {
+            let descend = if node.data.borrow().value.contains_inlines() {
+                // Only a block with a `[` can have a broken link.
+                let content = match deferred {
+                    Some(_) if node.data.borrow().content.contains(&b'[') => {
+                        Some(node.data.borrow().content.clone())
+                    }
+                    _ => None,
+                };
+                Self::parse_inlines(subj, options, node);
+                Self::postprocess_text_nodes(arena, options, node);
+                if let (Some(content), Some(deferred)) = (content, deferred.as_mut()) {
+                    let labels = subj.broken_labels.as_mut().unwrap();
+                    if !labels.is_empty() {
+                        deferred.push(DeferredBlock {
+                            node,
+                            content,
+                            labels: mem::replace(labels, vec![]),
+                        });
+                    }
+                }
+                false
+            } else {
+                true
+            };
+
+            next = match node.first_child() {
+                Some(child) if descend => Some(child),
+                _ => Self::next_in_preorder(top, node),
+            };
+        }
+    }
+
+    // Hands each top-level block closed since the last call to `done`, in
+    // order and with its inlines processed, until `done` returns true.
+    // `delivered` is the last block handed over.
+    fn deliver_closed_blocks<F>(
+        &mut self,
+        delivered: &mut Option<&'a AstNode<'a>>,
+        done: &mut F,
+    ) -> bool
+    where
+        F: FnMut(&'a AstNode<'a>) -> bool,
+    {
+        loop {
+            let next = match *delivered {
+                Some(node) => node.next_sibling(),
+                None => self.root.first_child(),
+            };
+            let node = match next {
+                Some(node) if !node.data.borrow().open => node,
+                _ => return false,
+            };
+            *delivered = Some(node);
+
+            self.process_block_inlines(node);
+            if done(node) {
+                return true;
+            }
+        }
+    }
+
+    fn process_block_inlines(&mut self, node: &'a AstNode<'a>) {
+        let scratch = self.take_inline_scratch();
+        let mut subj = inlines::Subject::with_scratch(
             self.arena,
             self.options,
-            content,
+            scratch,
             &mut self.refmap,
-            &delimiter_arena,
             self.callback.as_mut(),
         );
+        Self::process_inlines_within(self.arena, self.options, &mut subj, node, None);
+        self.inline_scratch = Some(subj.into_scratch());
+    }
 
-        while subj.parse_inline(node) {}
+    // As `deliver_closed_blocks`, but for `parse_streaming`: top-level tables
+    // are handed over as soon as they open, and then a row at a time, and
+    // footnote definitions are kept back.
+    fn stream_closed_blocks<S>(
+        &mut self,
+        state: &mut StreamState<'a>,
+        sink: &mut S,
+    ) -> io::Result<()>
+    where
+        S: StreamSink<'a>,
+    {
+        loop {
+            let node = match state.delivered {
+                Some(node) => node.next_sibling(),
+                None => self.root.first_child(),
+            };
+            let node = match node {
+                Some(node) => node,
+                None => return Ok(()),
+            };
+            let open = node.data.borrow().open;
 
-        subj.process_emphasis(None);
+            if node_matches!(node, NodeValue::Table(..)) {
+                if !state.table_started {
+                    if let NodeValue::Table(ref alignments) = node.data.borrow().value {
+                        state.alignments = alignments.clone();
+                    }
+                    self.stream_inlines(self.arena, node, state);
+                    sink.table_start(node)?;
+                    state.table_started = true;
+                }
+                for cells in mem::replace(&mut self.streamed_rows, vec![]) {
+                    self.stream_table_row(cells, state, sink)?;
+                }
+                if open {
+                    return Ok(());
+                }
+                sink.table_end(node)?;
+                state.table_started = false;
+                state.delivered = Some(node);
+            } else if open {
+                return Ok(());
+            } else {
+                self.stream_inlines(self.arena, node, state);
+                // A definition taken out of the tree leaves the last block
+                // delivered as it was.
+                if !self.take_footnote_definitions(node, state) {
+                    sink.block(node)?;
+                    state.delivered = Some(node);
+                }
+            }
+        }
+    }
 
-        while subj.pop_bracket() {}
+    // Builds a row of the table being streamed in an arena of its own, which
+    // is dropped as soon as the row has been handed to `sink`.
+    fn stream_table_row<S>(
+        &mut self,
+        cells: Vec<Vec<u8>>,
+        state: &mut StreamState<'a>,
+        sink: &mut S,
+    ) -> io::Result<()>
+    where
+        S: StreamSink<'a>,
+    {
+        let arena = Arena::new();
+        let table = arena.alloc(Node::new(RefCell::new(Ast::new(NodeValue::Table(
+            mem::replace(&mut state.alignments, vec![]),
+        )))));
+        let row = arena.alloc(Node::new(RefCell::new(Ast::new(NodeValue::TableRow(
+            false,
+        )))));
+        table.append(row);
+        for content in cells {
+            let mut cell = Ast::new(NodeValue::TableCell);
+            cell.content = content;
+            row.append(arena.alloc(Node::new(RefCell::new(cell))));
+        }
+
+        self.stream_inlines(&arena, row, state);
+        let result = sink.table_row(row);
+        if let NodeValue::Table(ref mut alignments) = table.data.borrow_mut().value {
+            state.alignments = mem::replace(alignments, vec![]);
+        }
+        result
     }
 
-    fn process_footnotes(&mut self) {
-        let mut map = HashMap::new();
-        Self::find_footnote_definitions(self.root, &mut map);
+    // Parses the inlines within `top`, which may belong to another arena,
+    // numbering footnote references on from those already in `state`.
+    fn stream_inlines<'b>(
+        &mut self,
+        arena: &'b Arena<AstNode<'b>>,
+        top: &'b AstNode<'b>,
+        state: &mut StreamState<'a>,
+    ) {
+        let scratch = self.take_inline_scratch();
+        let mut subj = inlines::Subject::with_scratch(
+            arena,
+            self.options,
+            scratch,
+            &mut self.refmap,
+            self.callback.as_mut(),
+        );
+        subj.footnotes = mem::replace(&mut state.numbers, FxHashMap::default());
+        subj.footnote_ix = state.footnote_ix;
+        Parser::process_inlines_within(arena, self.options, &mut subj, top, None);
+        state.numbers = mem::replace(&mut subj.footnotes, FxHashMap::default());
+        state.footnote_ix = subj.footnote_ix;
+        self.inline_scratch = Some(subj.into_scratch());
+    }
 
-        let mut ix = 0;
-        Self::find_footnote_references(self.root, &mut map, &mut ix);
+    // A subject can't be kept from one delivered block or streamed row to the
+    // next, since it borrows the refmap that the lines in between add to, and
+    // rows each have an arena of their own; what it can hand on is kept
+    // instead.
+    fn take_inline_scratch(&mut self) -> inlines::Scratch {
+        match self.inline_scratch.take() {
+            Some(scratch) => scratch,
+            None => inlines::Scratch::new(self.options),
+        }
+    }
 
-        if ix > 0 {
-            let mut v = map.into_iter().map(|(_, v)| v).collect::<Vec<_>>();
-            v.sort_unstable_by(|a, b| a.ix.cmp(&b.ix));
-            for f in v {
-                if f.ix.is_some() {
-                    match f.node.data.borrow_mut().value {
-                        NodeValue::FootnoteDefinition(ref mut name) => {
-                            *name = format!("{}", f.ix.unwrap()).into_bytes();
-                        }
-                        _ => unreachable!(),
-                    }
-                    self.root.append(f.node);
-                }
+    // Moves the top-level footnote definitions within `node`, a top-level
+    // block that has just closed, out of the tree and into `state`.  Returns
+    // whether `node` is itself one.
+    fn take_footnote_definitions(
+        &mut self,
+        node: &'a AstNode<'a>,
+        state: &mut StreamState<'a>,
+    ) -> bool {
+        let mut taken = false;
+        while let Some(&definition) = self.footnote_definitions.get(state.definitions_seen) {
+            if !definition.ancestors().any(|n| n.same_node(node)) {
+                break;
+            }
+            state.definitions_seen += 1;
+            if Self::within_footnote_definition(definition) {
+                continue;
+            }
+            if let NodeValue::FootnoteDefinition(ref name) = definition.data.borrow().value {
+                let name = strings::normalize_label(name);
+                state.numbers.entry(name.clone()).or_insert(None);
+                state.footnotes.insert(name, definition);
             }
+            definition.detach();
+            taken |= definition.same_node(node);
         }
+        taken
     }
 
-    fn find_footnote_definitions(
-        node: &'a AstNode<'a>,
-        map: &mut HashMap<Vec<u8>, FootnoteDefinition<'a>>,
-    ) {
-        match node.data.borrow().value {
-            NodeValue::FootnoteDefinition(ref name) => {
-                node.detach();
-                map.insert(
-                    strings::normalize_label(name),
-                    FootnoteDefinition { ix: None, node },
-                );
+    // The next node after `node` in a preorder walk of `root` that doesn't
+    // descend into `node`'s children.
+    fn next_in_preorder(
+        root: &'a AstNode<'a>,
+        mut node: &'a AstNode<'a>,
+    ) -> Option<&'a AstNode<'a>> {
+        loop {
+            if node.same_node(root) {
+                return None;
             }
-            _ => {
-                for n in node.children() {
-                    Self::find_footnote_definitions(n, map);
-                }
+            if let Some(sibling) = node.next_sibling() {
+                return Some(sibling);
             }
+            node = node.parent().unwrap();
         }
     }
 
-    fn find_footnote_references(
+    fn parse_inlines<'r, 'subj>(
+        subj: &mut inlines::Subject<'a, 'r, 'o, 'c, 'subj>,
+        options: &ComrakOptions,
         node: &'a AstNode<'a>,
-        map: &mut HashMap<Vec<u8>, FootnoteDefinition>,
-        ix: &mut u32,
     ) {
-        let mut ast = node.data.borrow_mut();
-        let mut replace = None;
-        match ast.value {
-            NodeValue::FootnoteReference(ref mut name) => {
-                if let Some(ref mut footnote) = map.get_mut(name) {
-                    if footnote.ix.is_none() {
-                        *ix += 1;
-                        footnote.ix = Some(*ix);
-                    }
-                    *name = format!("{}", footnote.ix.unwrap()).into_bytes();
-                } else {
-                    replace = Some(name.clone());
-                }
+        // The block's raw content isn't needed once its inlines are parsed,
+        // so hand the buffer to the subject rather than copying it.
+        let mut content = mem::replace(&mut node.data.borrow_mut().content, vec![]);
+        strings::rtrim(&mut content);
+        let task = if options.extension.tasklist {
+            Self::task_marker(node, &content)
+        } else {
+            None
+        };
+        if let Some((_, end)) = task {
+            content.drain(..end);
+        }
+        subj.reset(content);
+        subj.parse_block(node);
+        if let Some((checked, _)) = task {
+            node.prepend(inlines::make_inline(
+                subj.arena,
+                NodeValue::TaskItem(checked),
+            ));
+        }
+    }
+
+    // Whether `node` is the first paragraph of a list item whose `content`
+    // opens with a task marker (`[ ]`, `[x]` or `[X]`, then whitespace or
+    // nothing), and if so, whether it's checked and the length of the marker
+    // and any whitespace character after it on the same line.
+    fn task_marker(node: &'a AstNode<'a>, content: &[u8]) -> Option<(bool, usize)> {
+        if node.previous_sibling().is_some() || !node_matches!(node, NodeValue::Paragraph) {
+            return None;
+        }
+        match node.parent() {
+            Some(parent) if node_matches!(parent, NodeValue::Item(..)) => (),
+            _ => return None,
+        }
+
+        let start = content.iter().position(|&c| !isspace(c))?;
+        let checked = match content.get(start..start + 3) {
+            Some(b"[ ]") => false,
+            Some(b"[x]") | Some(b"[X]") => true,
+            _ => return None,
+        };
+        match content.get(start + 3) {
+            None | Some(&b'\r') | Some(&b'\n') => Some((checked, start + 3)),
+            Some(&c) if isspace(c) => Some((checked, start + 4)),
+            _ => None,
+        }
+    }
+
+    // Top-level footnote definitions by normalized name; a definition nested
+    // within another is left where it is.
+    fn collect_footnote_definitions(
+        definitions: &[&'a AstNode<'a>],
+    ) -> FxHashMap<Vec<u8>, &'a AstNode<'a>> {
+        let mut map = FxHashMap::default();
+        for &node in definitions {
+            if Self::within_footnote_definition(node) {
+                continue;
             }
-            _ => {
-                for n in node.children() {
-                    Self::find_footnote_references(n, map, ix);
-                }
+            if let NodeValue::FootnoteDefinition(ref name) = node.data.borrow().value {
+                map.insert(strings::normalize_label(name), node);
             }
         }
+        map
+    }
+
+    fn within_footnote_definition(node: &'a AstNode<'a>) -> bool {
+        node.ancestors()
+            .skip(1)
+            .any(|n| node_matches!(n, NodeValue::FootnoteDefinition(..)))
+    }
 
-        if let Some(mut label) = replace {
-            label.insert(0, b'[');
-            label.insert(1, b'^');
-            let len = label.len();
-            label.insert(len, b']');
-            ast.value = NodeValue::Text(label);
+    fn process_footnotes(
+        &mut self,
+        definitions: FxHashMap<Vec<u8>, &'a AstNode<'a>>,
+        numbers: FxHashMap<Vec<u8>, Option<u32>>,
+        ix: u32,
+    ) {
+        for &node in &self.footnote_definitions {
+            if !Self::within_footnote_definition(node) {
+                node.detach();
+            }
+        }
+
+        if ix > 0 {
+            for node in Self::number_footnotes(definitions, &numbers) {
+                self.root.append(node);
+            }
         }
     }
 
-    fn postprocess_text_nodes(&mut self, node: &'a AstNode<'a>) {
+    // The definitions of the footnotes that were referenced, in the order
+    // they were first referenced, each renamed to its number.
+    fn number_footnotes(
+        definitions: FxHashMap<Vec<u8>, &'a AstNode<'a>>,
+        numbers: &FxHashMap<Vec<u8>, Option<u32>>,
+    ) -> Vec<&'a AstNode<'a>> {
+        let mut v = definitions
+            .into_iter()
+            .filter_map(|(name, node)| match numbers.get(&name) {
+                Some(&Some(ix)) => Some((ix, node)),
+                _ => None,
+            })
+            .collect::<Vec<_>>();
+        v.sort_unstable_by_key(|&(ix, _)| ix);
+        v.into_iter()
+            .map(|(ix, node)| {
+                match node.data.borrow_mut().value {
+                    NodeValue::FootnoteDefinition(ref mut name) => {
+                        *name = format!("{}", ix).into_bytes();
+                    }
+                    _ => unreachable!(),
+                }
+                node
+            })
+            .collect()
+    }
+
+    fn postprocess_text_nodes(
+        arena: &'a Arena<AstNode<'a>>,
+        options: &ComrakOptions,
+        node: &'a AstNode<'a>,
+    ) {
         let mut stack = vec![node];
         let mut children = vec![];
 
@@ -1516,7 +2468,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                                 Some(ns) => ns,
                                 _ => {
                                     // Post-process once we are finished joining text nodes
-                                    self.postprocess_text_node(n, root);
+                                    Self::postprocess_text_node(arena, options, n, root);
                                     break;
                                 }
                             };
@@ -1528,7 +2480,7 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
                                 }
                                 _ => {
                                     // Post-process once we are finished joining text nodes
-                                    self.postprocess_text_node(n, root);
+                                    Self::postprocess_text_node(arena, options, n, root);
                                     break;
                                 }
                             }
@@ -1554,85 +2506,47 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         }
     }
 
-    fn postprocess_text_node(&mut self, node: &'a AstNode<'a>, text: &mut Vec<u8>) {
-        if self.options.extension.tasklist {
-            self.process_tasklist(node, text);
-        }
-
-        if self.options.extension.autolink {
-            autolink::process_autolinks(self.arena, node, text);
-        }
-    }
-
-    fn process_tasklist(&mut self, node: &'a AstNode<'a>, text: &mut Vec<u8>) {
-        lazy_static! {
-            static ref TASKLIST: Regex = Regex::new(r"\A(\s*\[([xX ])\])(?:\z|\s)").unwrap();
-        }
-
-        let (active, end) = match TASKLIST.captures(text) {
-            None => return,
-            Some(c) => (
-                c.get(2).unwrap().as_bytes() != b" ",
-                c.get(0).unwrap().end(),
-            ),
-        };
-
-        let parent = node.parent().unwrap();
-        if node.previous_sibling().is_some() || parent.previous_sibling().is_some() {
-            return;
-        }
-
-        match parent.data.borrow().value {
-            NodeValue::Paragraph => (),
-            _ => return,
-        }
-
-        match parent.parent().unwrap().data.borrow().value {
-            NodeValue::Item(..) => (),
-            _ => return,
+    fn postprocess_text_node(
+        arena: &'a Arena<AstNode<'a>>,
+        options: &ComrakOptions,
+        node: &'a AstNode<'a>,
+        text: &mut Vec<u8>,
+    ) {
+        if options.extension.autolink {
+            autolink::process_autolinks(arena, node, text);
         }
-
-        *text = text[end..].to_vec();
-        let checkbox = inlines::make_inline(self.arena, NodeValue::TaskItem(active));
-        node.insert_before(checkbox);
     }
 
-    fn parse_reference_inline(&mut self, content: &[u8]) -> Option<usize> {
-        // In this case reference inlines rarely have delimiters
-        // so we often just need the minimal case
-        let delimiter_arena = Arena::with_capacity(0);
-        let mut subj = inlines::Subject::new(
-            self.arena,
-            self.options,
-            content,
-            &mut self.refmap,
-            &delimiter_arena,
-            self.callback.as_mut(),
-        );
-
-        let mut lab: Vec<u8> = match subj.link_label() {
+    // Parses one link reference definition at `subj.pos`, adding it to the
+    // refmap. `subj.pos` is only meaningful afterwards if this succeeds.
+    fn parse_reference_inline<'r, 'subj>(
+        subj: &mut inlines::Subject<'a, 'r, 'o, 'c, 'subj>,
+    ) -> bool {
+        let lab = match subj.link_label() {
             Some(lab) => {
                 if lab.is_empty() {
-                    return None;
+                    return false;
                 } else {
-                    lab
+                    strings::normalize_label(lab)
                 }
             }
-            None => return None,
-        }
-        .to_vec();
+            None => return false,
+        };
 
         if subj.peek_char() != Some(&(b':')) {
-            return None;
+            return false;
         }
 
         subj.pos += 1;
         subj.spnl();
-        let (url, matchlen) = match inlines::manual_scan_link_url(&subj.input[subj.pos..]) {
-            Some((url, matchlen)) => (url, matchlen),
-            None => return None,
+        let url = match inlines::manual_scan_link_url(&subj.input[subj.pos..]) {
+            Some((url, matchlen)) => {
+                let url = strings::clean_url(url).into_owned();
+                subj.pos += matchlen;
+                url
+            }
+            None => return false,
         };
-        subj.pos += matchlen;
 
         let beforetitle = subj.pos;
         subj.spnl();
@@ -1641,39 +2555,36 @@ impl<'a, 'o, 'c> Parser<'a, 'o, 'c> {
         } else {
             scanners::link_title(&subj.input[subj.pos..])
         };
-        let title = match title_search {
+        let (starttitle, endtitle) = match title_search {
             Some(matchlen) => {
-                let t = &subj.input[subj.pos..subj.pos + matchlen];
+                let t = (subj.pos, subj.pos + matchlen);
                 subj.pos += matchlen;
-                t.to_vec()
+                t
             }
             _ => {
                 subj.pos = beforetitle;
-                vec![]
+                (0, 0)
             }
         };
 
         subj.skip_spaces();
         if !subj.skip_line_end() {
-            if !title.is_empty() {
+            if starttitle != endtitle {
                 subj.pos = beforetitle;
                 subj.skip_spaces();
                 if !subj.skip_line_end() {
-                    return None;
+                    return false;
                 }
             } else {
-                return None;
+                return false;
             }
         }
 
-        lab = strings::normalize_label(&lab);
         if !lab.is_empty() {
-            subj.refmap.entry(lab.to_vec()).or_insert(Reference {
-                url: strings::clean_url(&url),
-                title: strings::clean_title(&title),
-            });
+            let title = strings::clean_title(&subj.input[starttitle..endtitle]).into_owned();
+            subj.refmap.entry(lab).or_insert(Reference { url, title });
         }
-        Some(subj.pos)
+        true
     }
 }
 
@@ -4,7 +4,6 @@ use nodes::{Ast, AstNode, NodeValue, TableAlignment};
 use parser::Parser;
 use scanners;
 use std::cell::RefCell;
-use std::cmp::min;
 use strings::trim;
 
 pub fn try_opening_block<'a, 'o, 'c>(
@@ -12,15 +11,15 @@ pub fn try_opening_block<'a, 'o, 'c>(
     container: &'a AstNode<'a>,
     line: &[u8],
 ) -> Option<(&'a AstNode<'a>, bool)> {
-    let aligns = match container.data.borrow().value {
+    let columns = match container.data.borrow().value {
         NodeValue::Paragraph => None,
-        NodeValue::Table(ref aligns) => Some(aligns.clone()),
+        NodeValue::Table(ref aligns) => Some(aligns.len()),
         _ => return None,
     };
 
-    match aligns {
+    match columns {
         None => try_opening_header(parser, container, line),
-        Some(ref aligns) => try_opening_row(parser, container, aligns, line),
+        Some(columns) => try_opening_row(parser, container, columns, line),
     }
 }
 
@@ -88,23 +87,42 @@ fn try_opening_header<'a, 'o, 'c>(
 fn try_opening_row<'a, 'o, 'c>(
     parser: &mut Parser<'a, 'o, 'c>,
     container: &'a AstNode<'a>,
-    alignments: &[TableAlignment],
+    columns: usize,
     line: &[u8],
 ) -> Option<(&'a AstNode<'a>, bool)> {
     if parser.blank {
         return None;
     }
-    let this_row = row(&line[parser.first_nonspace..]).unwrap();
+    // The row was already tokenized when the line was matched as continuing
+    // the table.
+    let this_row = match parser.table_row.take() {
+        Some(this_row) => this_row,
+        None => row(&line[parser.first_nonspace..]).unwrap(),
+    };
+
+    let top_level = container
+        .parent()
+        .map_or(false, |parent| parent.same_node(parser.root));
+    if parser.stream_table_rows && top_level {
+        let mut cells = this_row.cells;
+        cells.resize(columns, vec![]);
+        parser.streamed_rows.push(cells);
+
+        let offset = line.len() - 1 - parser.offset;
+        parser.advance_offset(line, offset, false);
+        return Some((container, false));
+    }
+
     let new_row = parser.add_child(container, NodeValue::TableRow(false));
 
     let mut i = 0;
-    while i < min(alignments.len(), this_row.cells.len()) {
+    for content in this_row.cells.into_iter().take(columns) {
         let cell = parser.add_child(new_row, NodeValue::TableCell);
-        cell.data.borrow_mut().content = this_row.cells[i].clone();
+        cell.data.borrow_mut().content = content;
         i += 1;
     }
 
-    while i < alignments.len() {
+    while i < columns {
         parser.add_child(new_row, NodeValue::TableCell);
         i += 1;
     }
@@ -115,12 +133,12 @@ fn try_opening_row<'a, 'o, 'c>(
     Some((new_row, false))
 }
 
-struct Row {
+pub struct Row {
     paragraph_offset: usize,
     cells: Vec<Vec<u8>>,
 }
 
-fn row(string: &[u8]) -> Option<Row> {
+pub fn row(string: &[u8]) -> Option<Row> {
     let len = string.len();
     let mut cells = vec![];
     let mut offset = 0;
@@ -188,6 +206,7 @@ fn try_inserting_table_header_paragraph<'a, 'o, 'c>(
 
     let mut paragraph = Ast::new(NodeValue::Paragraph);
     paragraph.content = paragraph_content;
+    paragraph.open = false;
     let node = parser.arena.alloc(Node::new(RefCell::new(paragraph)));
     container.insert_before(node);
 }
@@ -206,7 +225,3 @@ fn unescape_pipes(string: &[u8]) -> Vec<u8> {
 
     v
 }
-
-pub fn matches(line: &[u8]) -> bool {
-    row(line).is_some()
-}
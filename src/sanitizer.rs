@@ -0,0 +1,604 @@
+use ctype::isspace;
+use entity;
+use html::{self, UrlSchemeFilter};
+use rustc_hash::{FxHashMap, FxHashSet};
+use std::io::{self, Write};
+use twoway::find_bytes;
+
+/// An allowlist of the HTML tags and attributes that raw HTML in a document may use.
+///
+/// Given to the HTML formatter through
+/// [`ComrakRenderPlugins::html_sanitizer`](struct.ComrakRenderPlugins.html#structfield.html_sanitizer),
+/// raw HTML is written (whether or not `render.unsafe_` is set) with everything else removed as
+/// it goes:
+///
+/// * Tags that aren't allowed are removed, but what's between them is kept, except for the
+///   contents of raw text elements such as `script` and `style`, which go with them.
+/// * Attributes that aren't allowed are removed, as are URL attributes such as `href` and `src`
+///   whose URLs use a dangerous scheme.  In attributes holding several URLs, such as `srcset`
+///   and `ping`, every URL is checked.
+/// * Event handler attributes such as `onclick`, and `srcdoc`, are always removed, even if
+///   allowed, since what they hold can't be checked.
+/// * Comments, processing instructions, declarations and CDATA sections are removed.
+/// * A `<` that doesn't start a tag is escaped.
+///
+/// `HtmlSanitizer::new()` allows common formatting tags, much as GitHub does, and
+/// `HtmlSanitizer::empty()` allows nothing.
+///
+/// ```
+/// # use comrak::{markdown_to_html_with_plugins, ComrakOptions, ComrakPlugins, HtmlSanitizer};
+/// let mut sanitizer = HtmlSanitizer::new();
+/// sanitizer.allow_tag("abbr", &["data-full"]);
+/// sanitizer.deny_tag("img");
+///
+/// let mut plugins = ComrakPlugins::default();
+/// plugins.render.html_sanitizer = Some(&sanitizer);
+///
+/// assert_eq!(
+///     markdown_to_html_with_plugins(
+///         "<B onclick=\"x()\">Hi</B> <abbr data-full='A \"B\"'>AB</abbr> <img src=x.png>\n\n\
+///          <a href=\" javascript:alert(1)\" title=t>x</a>\n",
+///         &ComrakOptions::default(),
+///         &plugins,
+///     ),
+///     "<p><b>Hi</b> <abbr data-full=\"A &quot;B&quot;\">AB</abbr> </p>\n\
+///      <p><a title=\"t\">x</a></p>\n"
+/// );
+/// ```
+#[derive(Debug, Clone)]
+pub struct HtmlSanitizer {
+    // Each allowed tag, with the attributes allowed on it alone.
+    tags: FxHashMap<Vec<u8>, FxHashSet<Vec<u8>>>,
+    // Attributes allowed on any allowed tag.
+    attributes: FxHashSet<Vec<u8>>,
+}
+
+// Tags allowed by `HtmlSanitizer::new`, each with the attributes allowed on it
+// alone.
+const DEFAULT_TAGS: &[(&str, &[&str])] = &[
+    ("a", &["href", "name"]),
+    ("abbr", &[]),
+    ("b", &[]),
+    ("bdo", &[]),
+    ("blockquote", &["cite"]),
+    ("br", &[]),
+    ("caption", &[]),
+    ("cite", &[]),
+    ("code", &[]),
+    ("dd", &[]),
+    ("del", &["cite", "datetime"]),
+    ("details", &["open"]),
+    ("dfn", &[]),
+    ("div", &[]),
+    ("dl", &[]),
+    ("dt", &[]),
+    ("em", &[]),
+    ("figcaption", &[]),
+    ("figure", &[]),
+    ("h1", &[]),
+    ("h2", &[]),
+    ("h3", &[]),
+    ("h4", &[]),
+    ("h5", &[]),
+    ("h6", &[]),
+    ("hr", &[]),
+    ("i", &[]),
+    ("img", &["src", "width", "height"]),
+    ("ins", &["cite", "datetime"]),
+    ("kbd", &[]),
+    ("li", &["value"]),
+    ("mark", &[]),
+    ("ol", &["start", "reversed", "type"]),
+    ("p", &[]),
+    ("pre", &[]),
+    ("q", &["cite"]),
+    ("rp", &[]),
+    ("rt", &[]),
+    ("ruby", &[]),
+    ("s", &[]),
+    ("samp", &[]),
+    ("small", &[]),
+    ("span", &[]),
+    ("strike", &[]),
+    ("strong", &[]),
+    ("sub", &[]),
+    ("summary", &[]),
+    ("sup", &[]),
+    ("table", &[]),
+    ("tbody", &[]),
+    ("td", &["colspan", "rowspan"]),
+    ("tfoot", &[]),
+    ("th", &["colspan", "rowspan", "scope"]),
+    ("thead", &[]),
+    ("time", &["datetime"]),
+    ("tr", &[]),
+    ("tt", &[]),
+    ("u", &[]),
+    ("ul", &[]),
+    ("var", &[]),
+    ("wbr", &[]),
+];
+
+// Attributes allowed by `HtmlSanitizer::new` on any allowed tag.
+const DEFAULT_ATTRIBUTES: &[&str] = &["align", "alt", "dir", "lang", "title"];
+
+// How an attribute holds URLs, for those that do.
+enum UrlAttribute {
+    Single,
+    // Several URLs, separated by whitespace, or by commas as in `srcset`.
+    List,
+}
+
+// Whether the attribute `name` holds URLs, which are checked before it's
+// written.
+fn url_attribute(name: &[u8]) -> Option<UrlAttribute> {
+    match name {
+        b"action" | b"background" | b"cite" | b"classid" | b"codebase" | b"data" | b"dynsrc"
+        | b"formaction" | b"href" | b"icon" | b"itemid" | b"longdesc" | b"lowsrc" | b"manifest"
+        | b"poster" | b"profile" | b"src" | b"usemap" | b"xlink:href" | b"xml:base" => {
+            Some(UrlAttribute::Single)
+        }
+        b"archive" | b"imagesrcset" | b"itemtype" | b"ping" | b"srcset" => Some(UrlAttribute::List),
+        _ => None,
+    }
+}
+
+// Elements whose contents are raw text rather than HTML, and so are removed
+// along with them.
+const RAW_TEXT_TAGS: &[&[u8]] = &[
+    b"iframe",
+    b"noembed",
+    b"noframes",
+    b"plaintext",
+    b"script",
+    b"style",
+    b"textarea",
+    b"title",
+    b"xmp",
+];
+
+// How much of a URL attribute's value past its scheme is decoded: enough for a
+// `data:` URL's media type.
+const URL_PREFIX_LENGTH: usize = 16;
+
+impl HtmlSanitizer {
+    /// A sanitizer allowing common formatting tags, links and images, with a few harmless
+    /// attributes.
+    pub fn new() -> Self {
+        let mut sanitizer = HtmlSanitizer::empty();
+        for &(tag, attributes) in DEFAULT_TAGS {
+            sanitizer.allow_tag(tag, attributes);
+        }
+        for &attribute in DEFAULT_ATTRIBUTES {
+            sanitizer.allow_attribute(attribute);
+        }
+        sanitizer
+    }
+
+    /// A sanitizer allowing nothing, so that all tags are removed.
+    pub fn empty() -> Self {
+        HtmlSanitizer {
+            tags: FxHashMap::default(),
+            attributes: FxHashSet::default(),
+        }
+    }
+
+    /// Allows `tag`, and `attributes` on it.  Names are matched case-insensitively.
+    pub fn allow_tag(&mut self, tag: &str, attributes: &[&str]) {
+        let allowed = self
+            .tags
+            .entry(tag.to_ascii_lowercase().into_bytes())
+            .or_insert_with(FxHashSet::default);
+        for attribute in attributes {
+            allowed.insert(attribute.to_ascii_lowercase().into_bytes());
+        }
+    }
+
+    /// Stops allowing `tag`.
+    pub fn deny_tag(&mut self, tag: &str) {
+        self.tags.remove(tag.to_ascii_lowercase().as_bytes());
+    }
+
+    /// Allows `attribute` on every allowed tag.
+    pub fn allow_attribute(&mut self, attribute: &str) {
+        self.attributes
+            .insert(attribute.to_ascii_lowercase().into_bytes());
+    }
+
+    /// Stops allowing `attribute`, on every tag.
+    pub fn deny_attribute(&mut self, attribute: &str) {
+        let attribute = attribute.to_ascii_lowercase().into_bytes();
+        self.attributes.remove(&attribute);
+        for allowed in self.tags.values_mut() {
+            allowed.remove(&attribute);
+        }
+    }
+
+    // Writes what's allowed of the raw HTML `input`, in a single pass over it.
+    pub(crate) fn sanitize(
+        &self,
+        input: &[u8],
+        url_scheme_filter: Option<&UrlSchemeFilter>,
+        o: &mut dyn Write,
+    ) -> io::Result<()> {
+        let mut i = 0;
+        while i < input.len() {
+            let text = i;
+            while i < input.len() && input[i] != b'<' {
+                i += 1;
+            }
+            o.write_all(&input[text..i])?;
+            if i == input.len() {
+                break;
+            }
+
+            i = match self.sanitize_markup(input, i, url_scheme_filter, o)? {
+                Some(end) => end,
+                None => {
+                    o.write_all(b"&lt;")?;
+                    i + 1
+                }
+            };
+        }
+        Ok(())
+    }
+
+    // Writes what's allowed of the markup starting with the `<` at
+    // `input[start]`, and returns where it ends, or `None` if it isn't markup
+    // after all.
+    fn sanitize_markup(
+        &self,
+        input: &[u8],
+        start: usize,
+        url_scheme_filter: Option<&UrlSchemeFilter>,
+        o: &mut dyn Write,
+    ) -> io::Result<Option<usize>> {
+        let rest = &input[start..];
+        let skipped = if rest.starts_with(b"<!--") {
+            Some(skip_past(input, start + 4, b"-->"))
+        } else if rest.starts_with(b"<![CDATA[") {
+            Some(skip_past(input, start + 9, b"]]>"))
+        } else if rest.starts_with(b"<?") {
+            Some(skip_past(input, start + 2, b"?>"))
+        } else if rest.starts_with(b"<!") && rest.len() > 2 && rest[2].is_ascii_alphabetic() {
+            Some(skip_past(input, start + 2, b">"))
+        } else {
+            None
+        };
+        if skipped.is_some() {
+            return Ok(skipped);
+        }
+
+        let closing = rest.len() > 1 && rest[1] == b'/';
+        let name_start = start + if closing { 2 } else { 1 };
+        let mut i = name_start;
+        if i >= input.len() || !input[i].is_ascii_alphabetic() {
+            return Ok(None);
+        }
+        while i < input.len() && (input[i].is_ascii_alphanumeric() || input[i] == b'-') {
+            i += 1;
+        }
+        let name = input[name_start..i].to_ascii_lowercase();
+        let allowed = self.tags.get(&name);
+
+        if closing {
+            while i < input.len() && isspace(input[i]) {
+                i += 1;
+            }
+            if i == input.len() || input[i] != b'>' {
+                return Ok(None);
+            }
+            if allowed.is_some() {
+                o.write_all(b"</")?;
+                o.write_all(&name)?;
+                o.write_all(b">")?;
+            }
+            return Ok(Some(i + 1));
+        }
+
+        let mut attributes = vec![];
+        let (end, self_closing) = match scan_attributes(input, i, &mut attributes) {
+            Some(end) => end,
+            None => return Ok(None),
+        };
+
+        let allowed = match allowed {
+            Some(allowed) => allowed,
+            None => {
+                if name == b"plaintext" {
+                    return Ok(Some(input.len()));
+                }
+                if RAW_TEXT_TAGS.contains(&&name[..]) {
+                    return Ok(Some(skip_raw_text(input, end, &name)));
+                }
+                return Ok(Some(end));
+            }
+        };
+
+        o.write_all(b"<")?;
+        o.write_all(&name)?;
+        for &(attribute, value) in &attributes {
+            let attribute = input[attribute.0..attribute.1].to_ascii_lowercase();
+            if !allowed.contains(&attribute) && !self.attributes.contains(&attribute) {
+                continue;
+            }
+            if attribute.starts_with(b"on") || attribute == b"srcdoc" {
+                continue;
+            }
+            match value {
+                Some(value) => {
+                    let value = &input[value.0..value.1];
+                    let dangerous = |url: Vec<u8>| match url_scheme_filter {
+                        Some(filter) => filter.is_dangerous(&url),
+                        None => html::dangerous_url(&url),
+                    };
+                    let dangerous = match url_attribute(&attribute) {
+                        Some(UrlAttribute::Single) => dangerous(url_prefix(Decoded::new(value))),
+                        // A browser finds the URLs in a list as runs of
+                        // characters other than whitespace, with trailing
+                        // commas removed.  Each one's scheme then starts one
+                        // of these pieces, so checking them all is enough.
+                        Some(UrlAttribute::List) => Decoded::new(value)
+                            .collect::<Vec<u8>>()
+                            .split(|&c| c.is_ascii_whitespace() || c == b',')
+                            .any(|url| dangerous(url_prefix(url.iter().cloned()))),
+                        None => false,
+                    };
+                    if dangerous {
+                        continue;
+                    }
+                    o.write_all(b" ")?;
+                    o.write_all(&attribute)?;
+                    o.write_all(b"=\"")?;
+                    write_attribute_value(value, o)?;
+                    o.write_all(b"\"")?;
+                }
+                None => {
+                    o.write_all(b" ")?;
+                    o.write_all(&attribute)?;
+                }
+            }
+        }
+        o.write_all(if self_closing { b" />" } else { b">" })?;
+
+        Ok(Some(end))
+    }
+}
+
+impl Default for HtmlSanitizer {
+    fn default() -> Self {
+        HtmlSanitizer::new()
+    }
+}
+
+type Span = (usize, usize);
+
+// Scans the attributes of an opening tag from `input[i]`, just after its name,
+// to the end of the tag.  Returns where the tag ends and whether it ends with
+// `/>`, or `None` if it doesn't end.
+fn scan_attributes(
+    input: &[u8],
+    mut i: usize,
+    attributes: &mut Vec<(Span, Option<Span>)>,
+) -> Option<(usize, bool)> {
+    loop {
+        while i < input.len() && isspace(input[i]) {
+            i += 1;
+        }
+        if i == input.len() {
+            return None;
+        }
+        match input[i] {
+            b'>' => return Some((i + 1, false)),
+            b'/' if input.get(i + 1) == Some(&b'>') => return Some((i + 2, true)),
+            b'/' => {
+                i += 1;
+                continue;
+            }
+            _ => (),
+        }
+
+        let name_start = i;
+        while i < input.len() && !isspace(input[i]) && !b"\"'<>/=".contains(&input[i]) {
+            i += 1;
+        }
+        if i == name_start {
+            return None;
+        }
+        let name = (name_start, i);
+
+        while i < input.len() && isspace(input[i]) {
+            i += 1;
+        }
+        if i == input.len() || input[i] != b'=' {
+            attributes.push((name, None));
+            continue;
+        }
+        i += 1;
+        while i < input.len() && isspace(input[i]) {
+            i += 1;
+        }
+        if i == input.len() {
+            return None;
+        }
+
+        let value = if input[i] == b'"' || input[i] == b'\'' {
+            let quote = input[i];
+            let value_start = i + 1;
+            i = value_start;
+            while i < input.len() && input[i] != quote {
+                i += 1;
+            }
+            if i == input.len() {
+                return None;
+            }
+            i += 1;
+            (value_start, i - 1)
+        } else {
+            let value_start = i;
+            while i < input.len() && !isspace(input[i]) && input[i] != b'>' {
+                i += 1;
+            }
+            if i == value_start {
+                return None;
+            }
+            (value_start, i)
+        };
+        attributes.push((name, Some(value)));
+    }
+}
+
+// Where the first `delimiter` at or after `input[i]` ends, or the end of the
+// input if there's none.
+fn skip_past(input: &[u8], i: usize, delimiter: &[u8]) -> usize {
+    match find_bytes(&input[i..], delimiter) {
+        Some(j) => i + j + delimiter.len(),
+        None => input.len(),
+    }
+}
+
+// Where the contents of the raw text element `name`, opened by a tag ending at
+// `input[i]`, end along with its closing tag, or the end of the input if it
+// isn't closed.
+fn skip_raw_text(input: &[u8], mut i: usize, name: &[u8]) -> usize {
+    while i < input.len() {
+        if input[i] == b'<'
+            && input.get(i + 1) == Some(&b'/')
+            && input.len() >= i + 2 + name.len()
+            && input[i + 2..i + 2 + name.len()].eq_ignore_ascii_case(name)
+        {
+            return skip_past(input, i + 2 + name.len(), b">");
+        }
+        i += 1;
+    }
+    input.len()
+}
+
+// Writes an attribute value to go between double quotes.  Character
+// references in it are left as they are.
+fn write_attribute_value(value: &[u8], o: &mut dyn Write) -> io::Result<()> {
+    let mut written = 0;
+    for (i, &c) in value.iter().enumerate() {
+        let escaped: &[u8] = match c {
+            b'"' => b"&quot;",
+            b'<' => b"&lt;",
+            b'>' => b"&gt;",
+            _ => continue,
+        };
+        o.write_all(&value[written..i])?;
+        o.write_all(escaped)?;
+        written = i + 1;
+    }
+    o.write_all(&value[written..])
+}
+
+// The start of the URL a browser would take from the decoded bytes of an
+// attribute value, enough of it to check its scheme: leading spaces and
+// control characters are dropped, and tabs and newlines are removed
+// throughout.  Reading stops early at anything that can't be part of a scheme.
+fn url_prefix<I: Iterator<Item = u8>>(bytes: I) -> Vec<u8> {
+    let mut url = vec![];
+    let mut scheme_end = None;
+    for c in bytes {
+        match scheme_end {
+            Some(end) if url.len() >= end + URL_PREFIX_LENGTH => break,
+            Some(_) => (),
+            None => match url.last() {
+                Some(&b':') => scheme_end = Some(url.len()),
+                Some(&last)
+                    if !last.is_ascii_alphanumeric()
+                        && last != b'+'
+                        && last != b'-'
+                        && last != b'.' =>
+                {
+                    break
+                }
+                _ => (),
+            },
+        }
+        push_url_byte(&mut url, c);
+    }
+    url
+}
+
+// The bytes of an attribute value as a browser reads them, with character
+// references decoded, numeric ones even without their `;`.  Only ASCII matters
+// for checking URLs, so a numeric reference to anything else reads as 0x80.
+struct Decoded<'v> {
+    value: &'v [u8],
+    i: usize,
+    // The rest of a named reference's characters, last first.
+    pending: Vec<u8>,
+}
+
+impl<'v> Decoded<'v> {
+    fn new(value: &'v [u8]) -> Self {
+        Decoded {
+            value,
+            i: 0,
+            pending: vec![],
+        }
+    }
+}
+
+impl<'v> Iterator for Decoded<'v> {
+    type Item = u8;
+
+    fn next(&mut self) -> Option<u8> {
+        if let Some(c) = self.pending.pop() {
+            return Some(c);
+        }
+        let c = *self.value.get(self.i)?;
+        self.i += 1;
+        if c == b'&' {
+            let rest = &self.value[self.i..];
+            if let Some((codepoint, len)) = numeric_reference(rest) {
+                self.i += len;
+                return Some(if codepoint < 0x80 {
+                    codepoint as u8
+                } else {
+                    0x80
+                });
+            }
+            if let Some((chs, len)) = entity::unescape(rest) {
+                self.i += len;
+                self.pending = chs;
+                self.pending.reverse();
+                return self.pending.pop();
+            }
+        }
+        Some(c)
+    }
+}
+
+fn push_url_byte(url: &mut Vec<u8>, c: u8) {
+    if c == b'\t' || c == b'\n' || c == b'\r' || (url.is_empty() && c <= b' ') {
+        return;
+    }
+    url.push(c);
+}
+
+// A numeric character reference after its `&`, with or without its `;`, as
+// browsers accept it in attribute values: its codepoint and length.
+fn numeric_reference(text: &[u8]) -> Option<(u32, usize)> {
+    if text.first() != Some(&b'#') {
+        return None;
+    }
+    let (radix, mut i) = match text.get(1) {
+        Some(&b'x') | Some(&b'X') => (16, 2),
+        _ => (10, 1),
+    };
+    let digits = i;
+    let mut codepoint: u32 = 0;
+    while let Some(digit) = text.get(i).and_then(|&c| (c as char).to_digit(radix)) {
+        codepoint = codepoint.saturating_mul(radix).saturating_add(digit);
+        i += 1;
+    }
+    if i == digits {
+        return None;
+    }
+    if text.get(i) == Some(&b';') {
+        i += 1;
+    }
+    Some((codepoint, i))
+}
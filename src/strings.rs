@@ -1,53 +1,95 @@
 use ctype::{ispunct, isspace};
 use entity;
 use parser::AutolinkType;
+use std::borrow::Cow;
 use std::ptr;
 use std::str;
 
-pub fn unescape(v: &mut Vec<u8>) {
-    let mut r = 0;
-    let mut prev = None;
-    let mut found = 0;
+/// Decodes entity references and then backslash escapes, with the same
+/// result as `entity::unescape_html` followed by a backslash-unescaping pass,
+/// but in a single left-to-right pass with one write cursor.  A backslash
+/// produced by an entity can still escape the byte after it; an escaped
+/// backslash cannot.
+pub fn unescape_html_and_backslashes(src: &[u8]) -> Cow<'_, [u8]> {
+    let special = |c: &u8| *c == b'&' || *c == b'\\';
+
+    let mut i = match src.iter().position(special) {
+        Some(i) => i,
+        None => return Cow::Borrowed(src),
+    };
 
-    while r < v.len() {
-        if v[r] == b'\\' && r + 1 < v.len() && ispunct(v[r + 1]) {
-            if let Some(prev) = prev {
-                let window = &mut v[(prev + 1 - found)..r];
-                shift_buf_left(window, found);
+    let mut v = Vec::with_capacity(src.len());
+    v.extend_from_slice(&src[..i]);
+    // Whether the last byte written is a backslash which may yet escape the
+    // next one.
+    let mut escaping = false;
+
+    while i < src.len() {
+        if src[i] == b'&' {
+            if let Some((chs, len)) = entity::unescape(&src[i + 1..]) {
+                for &c in &chs {
+                    push_unescaped(&mut v, &mut escaping, c);
+                }
+                i += len + 1;
+                continue;
             }
-            prev = Some(r);
-            found += 1;
         }
-        r += 1;
-    }
 
-    if let Some(prev) = prev {
-        let window = &mut v[(prev + 1 - found)..r];
-        shift_buf_left(window, found);
+        push_unescaped(&mut v, &mut escaping, src[i]);
+        i += 1;
+
+        let run = src[i..].iter().position(special).unwrap_or(src.len() - i);
+        if run > 0 {
+            if escaping && ispunct(src[i]) {
+                push_unescaped(&mut v, &mut escaping, src[i]);
+                v.extend_from_slice(&src[i + 1..i + run]);
+            } else {
+                v.extend_from_slice(&src[i..i + run]);
+            }
+            escaping = false;
+            i += run;
+        }
     }
 
-    let new_size = v.len() - found;
-    v.truncate(new_size);
+    Cow::Owned(v)
 }
 
-pub fn clean_autolink(url: &[u8], kind: AutolinkType) -> Vec<u8> {
-    let mut url_vec = url.to_vec();
-    trim(&mut url_vec);
-
-    if url_vec.is_empty() {
-        return url_vec;
+#[inline]
+fn push_unescaped(v: &mut Vec<u8>, escaping: &mut bool, c: u8) {
+    if *escaping && ispunct(c) {
+        let last = v.len() - 1;
+        v[last] = c;
+        *escaping = false;
+    } else {
+        v.push(c);
+        *escaping = c == b'\\';
     }
+}
 
-    let mut buf = Vec::with_capacity(url_vec.len());
-    if kind == AutolinkType::Email {
-        buf.extend_from_slice(b"mailto:");
+pub fn clean_autolink(url: &[u8], kind: AutolinkType) -> Cow<'_, [u8]> {
+    let url = trim_slice(url);
+
+    if url.is_empty() || kind != AutolinkType::Email {
+        return entity::unescape_html(url);
     }
 
-    buf.extend_from_slice(&entity::unescape_html(&url_vec));
-    buf
+    let mut buf = Vec::with_capacity(url.len() + 7);
+    buf.extend_from_slice(b"mailto:");
+    buf.extend_from_slice(&entity::unescape_html(url));
+    Cow::Owned(buf)
 }
 
-pub fn normalize_code(v: &[u8]) -> Vec<u8> {
+pub fn normalize_code(v: &[u8]) -> Cow<'_, [u8]> {
+    // Without line endings to convert, the result is the input with at most
+    // one space stripped from each end, so can be borrowed.
+    if !v.iter().any(|&c| is_line_end_char(c)) {
+        let contains_nonspace = v.iter().any(|&c| c != b' ');
+        if contains_nonspace && !v.is_empty() && v[0] == b' ' && v[v.len() - 1] == b' ' {
+            return Cow::Borrowed(&v[1..v.len() - 1]);
+        }
+        return Cow::Borrowed(v);
+    }
+
     let mut r = Vec::with_capacity(v.len());
     let mut i = 0;
     let mut contains_nonspace = false;
@@ -76,7 +118,7 @@ pub fn normalize_code(v: &[u8]) -> Vec<u8> {
         r.pop();
     }
 
-    r
+    Cow::Owned(r)
 }
 
 pub fn remove_trailing_blank_lines(line: &mut Vec<u8>) {
@@ -182,40 +224,34 @@ fn shift_buf_left(buf: &mut [u8], n: usize) {
     }
 }
 
-pub fn clean_url(url: &[u8]) -> Vec<u8> {
+pub fn clean_url(url: &[u8]) -> Cow<'_, [u8]> {
     let url = trim_slice(url);
 
     let url_len = url.len();
     if url_len == 0 {
-        return vec![];
+        return Cow::Borrowed(url);
     }
 
-    let mut b = entity::unescape_html(url);
-
-    unescape(&mut b);
-    b
+    unescape_html_and_backslashes(url)
 }
 
-pub fn clean_title(title: &[u8]) -> Vec<u8> {
+pub fn clean_title(title: &[u8]) -> Cow<'_, [u8]> {
     let title_len = title.len();
     if title_len == 0 {
-        return vec![];
+        return Cow::Borrowed(title);
     }
 
     let first = title[0];
     let last = title[title_len - 1];
 
-    let mut b = if (first == b'\'' && last == b'\'')
+    if (first == b'\'' && last == b'\'')
         || (first == b'(' && last == b')')
         || (first == b'"' && last == b'"')
     {
-        entity::unescape_html(&title[1..title_len - 1])
+        unescape_html_and_backslashes(&title[1..title_len - 1])
     } else {
-        entity::unescape_html(title)
-    };
-
-    unescape(&mut b);
-    b
+        unescape_html_and_backslashes(title)
+    }
 }
 
 pub fn is_blank(s: &[u8]) -> bool {
@@ -230,21 +266,48 @@ pub fn is_blank(s: &[u8]) -> bool {
 }
 
 pub fn normalize_label(i: &[u8]) -> Vec<u8> {
+    let mut v = Vec::with_capacity(i.len());
+    normalize_label_into(i, &mut v);
+    v
+}
+
+/// Like `normalize_label`, but writes into `v` (replacing its contents) so
+/// that a buffer can be reused across lookups.
+pub fn normalize_label_into(i: &[u8], v: &mut Vec<u8>) {
     let i = trim_slice(i);
-    let mut v = String::with_capacity(i.len());
+    v.clear();
     let mut last_was_whitespace = false;
+
+    if i.is_ascii() {
+        for &c in i {
+            match c {
+                b'\t' | b'\n' | 0x0b | 0x0c | b'\r' | b' ' => {
+                    if !last_was_whitespace {
+                        last_was_whitespace = true;
+                        v.push(b' ');
+                    }
+                }
+                _ => {
+                    last_was_whitespace = false;
+                    v.push(c.to_ascii_lowercase());
+                }
+            }
+        }
+        return;
+    }
+
+    let mut buf = [0; 4];
     for c in unsafe { str::from_utf8_unchecked(i) }.chars() {
         for e in c.to_lowercase() {
             if e.is_whitespace() {
                 if !last_was_whitespace {
                     last_was_whitespace = true;
-                    v.push(' ');
+                    v.push(b' ');
                 }
             } else {
                 last_was_whitespace = false;
-                v.push(e);
+                v.extend_from_slice(e.encode_utf8(&mut buf).as_bytes());
             }
         }
     }
-    v.into_bytes()
 }
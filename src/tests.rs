@@ -26,6 +26,7 @@ fn fuzz_doesnt_crash(md: String) {
         parse: ComrakParseOptions {
             smart: true,
             default_info_string: Some("Rust".to_string()),
+            reference_definitions: None,
         },
         render: ComrakRenderOptions {
             hardbreaks: true,
@@ -145,6 +146,78 @@ fn codefence() {
     );
 }
 
+#[test]
+fn codefence_syntax_highlighter() {
+    use adapters::{CachedSyntaxHighlighter, SyntaxHighlighterAdapter};
+    use std::cell::Cell;
+    use std::io::{self, Write};
+
+    struct Tagging(Cell<usize>);
+
+    impl SyntaxHighlighterAdapter for Tagging {
+        fn highlight(&self, output: &mut dyn Write, info: &str, code: &str) -> io::Result<bool> {
+            self.0.set(self.0.get() + 1);
+            if info.is_empty() {
+                return Ok(false);
+            }
+            write!(output, "<span>{}|{}</span>", info, code.trim_end())?;
+            Ok(true)
+        }
+    }
+
+    let input = concat!(
+        "``` rust yum\n",
+        "<a>\n",
+        "```\n",
+        "\n",
+        "    <b>\n",
+        "\n",
+        "```rust\n",
+        "<a>\n",
+        "```\n",
+        "\n",
+        "```rust\n",
+        "<c>\n",
+        "```\n",
+    );
+    let expected = concat!(
+        "<pre><code class=\"language-rust\"><span>rust yum|<a></span></code></pre>\n",
+        "<pre><code>&lt;b&gt;\n",
+        "</code></pre>\n",
+        "<pre><code class=\"language-rust\"><span>rust|<a></span></code></pre>\n",
+        "<pre><code class=\"language-rust\"><span>rust|<c></span></code></pre>\n",
+    );
+    let options = ComrakOptions::default();
+
+    let adapter = Tagging(Cell::new(0));
+    let mut plugins = ::ComrakPlugins::default();
+    plugins.render.codefence_syntax_highlighter = Some(&adapter);
+    assert_eq!(
+        ::markdown_to_html_with_plugins(input, &options, &plugins),
+        expected
+    );
+    assert_eq!(adapter.0.get(), 4);
+
+    // Each distinct info string and code, declined or not, is highlighted
+    // once.  With room for only three of the four, each is forgotten before
+    // it comes round again.
+    for &(capacity, calls) in &[(4, 4), (3, 8)] {
+        let cache = CachedSyntaxHighlighter::new(Tagging(Cell::new(0)), capacity);
+        let mut plugins = ::ComrakPlugins::default();
+        plugins.render.codefence_syntax_highlighter = Some(&cache);
+        for _ in 0..2 {
+            assert_eq!(
+                ::markdown_to_html_with_plugins(input, &options, &plugins),
+                expected
+            );
+        }
+        assert_eq!(cache.len(), capacity);
+        assert_eq!(cache.adapter().0.get(), calls);
+        cache.clear();
+        assert!(cache.is_empty());
+    }
+}
+
 #[test]
 fn lists() {
     html(
@@ -381,6 +454,62 @@ fn entities() {
     );
 }
 
+#[test]
+fn escapes_in_link_and_info() {
+    html(
+        concat!(
+            "[a](x\\\\*y \"t\\\\*&#92;*\")\n",
+            "\n",
+            "``` a\\*&#92;&#42;\n",
+            "z\n",
+            "```\n"
+        ),
+        concat!(
+            "<p><a href=\"x%5C*y\" title=\"t\\**\">a</a></p>\n",
+            "<pre><code class=\"language-a**\">z\n",
+            "</code></pre>\n"
+        ),
+    );
+}
+
+#[test]
+fn front_matter() {
+    let mut options = ComrakOptions::default();
+    options.extension.front_matter_delimiter = Some("---".to_string());
+
+    for &(input, front_matter, html) in &[
+        (
+            "---\nlayout: post\n---\nText\n",
+            Some("---\nlayout: post\n---\n"),
+            "<p>Text</p>\n",
+        ),
+        (
+            "\u{feff}---\r\na: b\r\n---\r\n# Hi\n",
+            Some("\u{feff}---\r\na: b\r\n---\r\n"),
+            "<h1>Hi</h1>\n",
+        ),
+        ("---\n---\nText\n", Some("---\n---\n"), "<p>Text</p>\n"),
+        (
+            "---\na: b\n ---\n----\n---",
+            None,
+            "<hr />\n<h2>a: b</h2>\n<hr />\n<hr />\n",
+        ),
+        ("x\n---\na\n---\n", None, "<h2>x</h2>\n<h2>a</h2>\n"),
+    ] {
+        let arena = Arena::new();
+        let root = parse_document(&arena, input, &options);
+        let found = match root.first_child().map(|n| n.data.borrow().value.clone()) {
+            Some(NodeValue::FrontMatter(fm)) => Some(String::from_utf8(fm).unwrap()),
+            _ => None,
+        };
+        assert_eq!(found.as_ref().map(|s| &s[..]), front_matter);
+
+        let mut output = vec![];
+        html::format_document(root, &options, &mut output).unwrap();
+        compare_strs(&String::from_utf8(output).unwrap(), html, "regular");
+    }
+}
+
 #[test]
 fn pointy_brace() {
     html_opts!(
@@ -455,6 +584,255 @@ fn reference_links() {
     );
 }
 
+#[test]
+fn reference_label_normalization() {
+    html(
+        concat!(
+            "[Foo\tBAR], [foo  bar][], [ΑΓΩ] and [ẞ].\n",
+            "\n",
+            "[ foo bar ]: /a\n",
+            "[αγω]: /b\n",
+            "[ß]: /c\n"
+        ),
+        concat!(
+            "<p><a href=\"/a\">Foo\tBAR</a>, <a href=\"/a\">foo  bar</a>, \
+             <a href=\"/b\">ΑΓΩ</a> and <a href=\"/c\">ẞ</a>.</p>\n"
+        ),
+    );
+}
+
+#[test]
+fn shared_reference_definitions() {
+    let mut options = ComrakOptions::default();
+    let defs = ::ReferenceDefinitions::parse(
+        concat!(
+            "Some text, ignored.\n",
+            "\n",
+            "[shared]: /shared\n",
+            "[Local]: /from-shared \"t\"\n",
+            "[Local]: /ignored\n"
+        ),
+        &options,
+    );
+    assert_eq!(defs.len(), 2);
+    options.parse.reference_definitions = Some(::std::sync::Arc::new(defs));
+
+    let arena = Arena::new();
+    let root = ::parse_document_with_broken_link_callback(
+        &arena,
+        "[shared] [local] [other]\n\n[LOCAL]: /local\n",
+        &options,
+        Some(&mut |label: &[u8]| Some((label.to_vec(), vec![]))),
+    );
+    let mut output = vec![];
+    html::format_document(root, &options, &mut output).unwrap();
+    compare_strs(
+        &String::from_utf8(output).unwrap(),
+        concat!(
+            "<p><a href=\"/shared\">shared</a> <a href=\"/local\">local</a> ",
+            "<a href=\"other\">other</a></p>\n"
+        ),
+        "regular",
+    );
+}
+
+#[test]
+fn broken_link_callback_per_occurrence() {
+    let mut calls = vec![];
+    {
+        let arena = Arena::new();
+        ::parse_document_with_broken_link_callback(
+            &arena,
+            "[a] [b] [A] [b]\n\n> [a]\n",
+            &ComrakOptions::default(),
+            Some(&mut |label: &[u8]| {
+                calls.push(label.to_vec());
+                None
+            }),
+        );
+    }
+    assert_eq!(calls, vec![&b"a"[..], b"b", b"a", b"b", b"a"]);
+}
+
+#[test]
+fn broken_link_callback_memoized() {
+    let mut calls = vec![];
+    {
+        let mut cache = ::BrokenLinkCache::new(
+            |label: &[u8]| {
+                calls.push(label.to_vec());
+                None
+            },
+            100,
+        );
+        let arena = Arena::new();
+        ::parse_document_with_broken_link_callback(
+            &arena,
+            "[a] [b] [A] [b]\n\n> [a]\n",
+            &ComrakOptions::default(),
+            Some(&mut |label: &[u8]| cache.resolve(label)),
+        );
+    }
+    assert_eq!(calls, vec![b"a".to_vec(), b"b".to_vec()]);
+
+    let mut calls = 0;
+    {
+        let mut cache = ::BrokenLinkCache::new(
+            |_: &[u8]| {
+                calls += 1;
+                Some((b"/x".to_vec(), vec![]))
+            },
+            2,
+        );
+        for label in &[&b"a"[..], b"b", b"a", b"c", b"a", b"c"] {
+            assert_eq!(cache.resolve(label), Some((b"/x".to_vec(), vec![])));
+        }
+        assert_eq!(cache.len(), 2);
+        cache.clear();
+        assert!(cache.is_empty());
+    }
+    // "c" evicts "a", which is then looked up again.
+    assert_eq!(calls, 4);
+}
+
+#[test]
+fn broken_link_batch() {
+    let resolve = |label: &[u8]| {
+        if label == b"missing" {
+            None
+        } else {
+            let mut url = b"/".to_vec();
+            url.extend_from_slice(label);
+            Some((url, vec![]))
+        }
+    };
+    let docs = [
+        "[a] [missing] *[b* c]\n\n> [A]\n\n[d]: /d\n",
+        "No links.\n",
+        "[d] [e][missing]\n",
+        "[A][](](/x)[^n])\n\n[^n]: Note.\n",
+    ];
+    let mut options = ComrakOptions::default();
+    options.extension.footnotes = true;
+
+    let mut batches = vec![];
+    let arena = Arena::new();
+    let roots = ::parse_documents_with_broken_link_batch(
+        &arena,
+        &docs,
+        &options,
+        &mut |labels: &[Vec<u8>]| {
+            batches.push(labels.to_vec());
+            labels.iter().map(|label| resolve(label)).collect()
+        },
+    );
+    // Resolving "a" in the last document turns up "^n" as a label.
+    assert_eq!(
+        batches,
+        vec![
+            vec![
+                b"a".to_vec(),
+                b"missing".to_vec(),
+                b"b* c".to_vec(),
+                b"d".to_vec(),
+            ],
+            vec![b"^n".to_vec()],
+        ]
+    );
+
+    for (doc, root) in docs.iter().zip(roots) {
+        let mut batched = vec![];
+        html::format_document(root, &options, &mut batched).unwrap();
+
+        let arena = Arena::new();
+        let root = ::parse_document_with_broken_link_callback(
+            &arena,
+            doc,
+            &options,
+            Some(&mut |label: &[u8]| resolve(label)),
+        );
+        let mut expected = vec![];
+        html::format_document(root, &options, &mut expected).unwrap();
+        compare_strs(
+            &String::from_utf8(batched).unwrap(),
+            &String::from_utf8(expected).unwrap(),
+            "batched",
+        );
+    }
+}
+
+#[test]
+fn parse_until() {
+    let options = ComrakOptions::default();
+    let input = concat!(
+        "[r]: /r\n",
+        "\n",
+        "Para [r] [s].\n",
+        "# *Title*\n",
+        "> Not read.\n",
+        "\n",
+        "[s]: /s\n"
+    );
+
+    let arena = Arena::new();
+    let mut seen = vec![];
+    let root = ::parse_document_until(&arena, input, &options, |node| {
+        let value = node.data.borrow().value.clone();
+        let done = match value {
+            NodeValue::Heading(..) => true,
+            _ => false,
+        };
+        seen.push(value);
+        done
+    });
+    assert_eq!(seen.len(), 2);
+    let mut output = vec![];
+    html::format_document(root, &options, &mut output).unwrap();
+    compare_strs(
+        &String::from_utf8(output).unwrap(),
+        "<p>Para <a href=\"/r\">r</a> [s].</p>\n<h1><em>Title</em></h1>\n",
+        "regular",
+    );
+
+    let arena = Arena::new();
+    let root = ::parse_document_until(&arena, input, &options, |_| false);
+    let mut output = vec![];
+    html::format_document(root, &options, &mut output).unwrap();
+    compare_strs(
+        &String::from_utf8(output).unwrap(),
+        concat!(
+            "<p>Para <a href=\"/r\">r</a> [s].</p>\n",
+            "<h1><em>Title</em></h1>\n",
+            "<blockquote>\n<p>Not read.</p>\n</blockquote>\n"
+        ),
+        "regular",
+    );
+}
+
+#[test]
+fn inline_state_per_block() {
+    html(
+        concat!(
+            "[a]: /u \"t\"\n",
+            "[b]: /v\n",
+            "foo *[bar* baz_\n",
+            "\n",
+            "_qux](/x) **[a]** [b]\n",
+            "\n",
+            "`` x\n",
+            "\n",
+            "y ``\n"
+        ),
+        concat!(
+            "<p>foo <em>[bar</em> baz_</p>\n",
+            "<p>_qux](/x) <strong><a href=\"/u\" title=\"t\">a</a></strong> \
+             <a href=\"/v\">b</a></p>\n",
+            "<p>`` x</p>\n",
+            "<p>y ``</p>\n"
+        ),
+    );
+}
+
 #[test]
 fn link_entity_regression() {
     html(
@@ -529,6 +907,48 @@ fn table_regression() {
     );
 }
 
+#[test]
+fn table_streaming() {
+    let mut options = ComrakOptions::default();
+    options.extension.table = true;
+    options.extension.footnotes = true;
+    options.extension.strikethrough = true;
+
+    for input in &[
+        concat!("| a | b |\n", "|---|:-:|\n", "| *c* | d |\n", "| e |\n"),
+        concat!(
+            "a|b\n",
+            ":-|-:\n",
+            "c|~~d~~\n",
+            "e|f\n",
+            "\n",
+            "x\n",
+            "-:\n",
+            "y\n"
+        ),
+        concat!("para\n", "a|b\n", "-|-\n", "c|d\n", "\n", "after\n"),
+        concat!("> a|b\n", "> -|-\n", "> c|d\n", "\n", "- x|y\n", "  -|-\n"),
+        concat!("[^1]: note\n", "\n", "a|b\n", "-|-\n", "\n", "text[^1]\n"),
+        concat!(
+            "> [^a]: x\n",
+            "\n",
+            "[^b]: y\n",
+            "\n",
+            "|h|\n",
+            "|-|\n",
+            "|[^b][^a]|\n"
+        ),
+    ] {
+        let mut output = vec![];
+        ::markdown_to_html_streaming(input, &options, &mut output).unwrap();
+        compare_strs(
+            &String::from_utf8(output).unwrap(),
+            &::markdown_to_html(input, &options),
+            "streaming",
+        );
+    }
+}
+
 #[test]
 fn autolink_www() {
     html_opts!(
@@ -590,6 +1010,96 @@ fn tagfilter() {
     );
 }
 
+#[test]
+fn html_sanitizer() {
+    let sanitize = |sanitizer: &::HtmlSanitizer, input: &str| {
+        let mut plugins = ::ComrakPlugins::default();
+        plugins.render.html_sanitizer = Some(sanitizer);
+        ::markdown_to_html_with_plugins(input, &ComrakOptions::default(), &plugins)
+    };
+    let sanitizer = ::HtmlSanitizer::new();
+
+    assert_eq!(
+        sanitize(
+            &sanitizer,
+            concat!(
+                "<DIV class=x>\n",
+                "<p>ok</p>\n",
+                "<!-- c -->\n",
+                "<style>p{}</style>\n",
+                "3 < 4 <b\n",
+                "</div>\n",
+            )
+        ),
+        concat!(
+            "<div>\n",
+            "<p>ok</p>\n",
+            "\n",
+            "\n",
+            "3 &lt; 4 &lt;b\n",
+            "</div>\n"
+        ),
+    );
+    assert_eq!(
+        sanitize(
+            &sanitizer,
+            "a <span style=\"x\" title='q'>b</span> <foo>c</foo> <br/>\n"
+        ),
+        "<p>a <span title=\"q\">b</span> c <br /></p>\n",
+    );
+    assert_eq!(
+        sanitize(&sanitizer, "a\n\n<script>\nalert(1);\n</script>\nb\n"),
+        "<p>a</p>\n\n<p>b</p>\n",
+    );
+    assert_eq!(
+        sanitize(
+            &sanitizer,
+            concat!(
+                "<a href=\"&#106avascript:x\">1</a> ",
+                "<a href=\"JaVa&#x09;ScRiPt&#58;x\">2</a> ",
+                "<img src=\"data:text/html,x\"> ",
+                "<img src=\"data:image/png;base64,AA\"> ",
+                "<a href=\"https://example.com/?a=1&amp;b\">3</a>\n",
+            )
+        ),
+        concat!(
+            "<p><a>1</a> <a>2</a> <img> <img src=\"data:image/png;base64,AA\"> ",
+            "<a href=\"https://example.com/?a=1&amp;b\">3</a></p>\n",
+        ),
+    );
+    assert_eq!(
+        sanitize(&::HtmlSanitizer::empty(), "<em>x</em> <a href=y>z</a>\n"),
+        "<p>x z</p>\n",
+    );
+
+    let mut sanitizer = ::HtmlSanitizer::new();
+    sanitizer.allow_tag("img", &["srcset"]);
+    sanitizer.allow_tag("a", &["ping", "xlink:href", "onclick"]);
+    sanitizer.allow_tag("object", &["data"]);
+    sanitizer.allow_tag("video", &["poster"]);
+    sanitizer.allow_tag("iframe", &["srcdoc"]);
+    assert_eq!(
+        sanitize(
+            &sanitizer,
+            concat!(
+                "x <img srcset=\"a.png 1x, javascript:alert(1) 2x\"> ",
+                "<img srcset=\"a.png,&#106;avascript:b\"> ",
+                "<img srcset=\"a.png 1x,data:image/png;base64,AA 2x\"> ",
+                "<a ping=\"/p javascript:x\" xlink:href=\"javascript:x\" onclick=\"x()\">1</a> ",
+                "<a ping=\"/p /q\">2</a> ",
+                "<object data=\"javascript:x\"></object> ",
+                "<video poster=\"javascript:x\"></video> ",
+                "<iframe srcdoc=\"&lt;script&gt;\"></iframe>\n",
+            )
+        ),
+        concat!(
+            "<p>x <img> <img> <img srcset=\"a.png 1x,data:image/png;base64,AA 2x\"> ",
+            "<a>1</a> <a ping=\"/p /q\">2</a> <object></object> <video></video> ",
+            "<iframe></iframe></p>\n",
+        ),
+    );
+}
+
 #[test]
 fn tasklist() {
     html_opts!(
@@ -654,6 +1164,50 @@ fn tasklist_32() {
     );
 }
 
+#[test]
+fn tasklist_markers() {
+    html_opts!(
+        [extension.tasklist],
+        concat!(
+            "- [X]\n",
+            "  wrapped\n",
+            "- [x]`code`\n",
+            "- \\[ ] escaped\n",
+            "- [x] linked\n",
+            "- x\n",
+            "\n",
+            "  [ ] later\n",
+            "- [ ] setext\n",
+            "  ---\n",
+            "\n",
+            "[x]: /u\n",
+        ),
+        concat!(
+            "<ul>\n",
+            "<li>\n",
+            "<p><input type=\"checkbox\" disabled=\"\" checked=\"\" /> \nwrapped</p>\n",
+            "</li>\n",
+            "<li>\n",
+            "<p><a href=\"/u\">x</a><code>code</code></p>\n",
+            "</li>\n",
+            "<li>\n",
+            "<p>[ ] escaped</p>\n",
+            "</li>\n",
+            "<li>\n",
+            "<p><input type=\"checkbox\" disabled=\"\" checked=\"\" /> linked</p>\n",
+            "</li>\n",
+            "<li>\n",
+            "<p>x</p>\n",
+            "<p>[ ] later</p>\n",
+            "</li>\n",
+            "<li>\n",
+            "<h2>[ ] setext</h2>\n",
+            "</li>\n",
+            "</ul>\n",
+        ),
+    );
+}
+
 #[test]
 fn superscript() {
     html_opts!(
@@ -760,6 +1314,39 @@ fn footnote_does_not_eat_exclamation() {
     );
 }
 
+#[test]
+fn footnote_label_must_be_single_text() {
+    html_opts!(
+        [extension.footnotes],
+        concat!("x[^a\\*b] y\n", "\n", "[^a*b]: Yep.\n"),
+        "<p>x[^a*b] y</p>\n",
+    );
+}
+
+#[test]
+fn footnote_missing_definition() {
+    html_opts!(
+        [extension.footnotes, extension.autolink],
+        concat!(
+            "Missing[^nope] www.example.com, and[^a].\n",
+            "\n",
+            "[^a]: A[^a].\n"
+        ),
+        concat!(
+            "<p>Missing[^nope] <a href=\"http://www.example.com\">www.example.com</a>, \
+             and<sup class=\"footnote-ref\"><a href=\"#fn1\" id=\"fnref1\">1</a></sup>.</p>\n",
+            "<section class=\"footnotes\">\n",
+            "<ol>\n",
+            "<li id=\"fn1\">\n",
+            "<p>A<sup class=\"footnote-ref\"><a href=\"#fna\" id=\"fnrefa\">a</a></sup>. \
+             <a href=\"#fnref1\" class=\"footnote-backref\">↩</a></p>\n",
+            "</li>\n",
+            "</ol>\n",
+            "</section>\n"
+        ),
+    );
+}
+
 #[test]
 fn footnote_in_table() {
     html_opts!(
@@ -851,6 +1438,40 @@ fn smart_chars() {
     );
 }
 
+#[test]
+fn emphasis_flanking_unicode() {
+    html("«*b*» 「_c_」", "<p>«<em>b</em>» 「<em>c</em>」</p>\n");
+    html("a*«b»*c foo_「bar」_", "<p>a*«b»*c foo_「bar」_</p>\n");
+    html(
+        "x\u{3000}*y*\u{3000}z",
+        "<p>x\u{3000}<em>y</em>\u{3000}z</p>\n",
+    );
+}
+
+#[test]
+fn flanking_tables_match_ranges() {
+    use ctype::{flanking, is_punctuation, Flanking};
+    use std::char;
+
+    for c in 0..=0x10ffff {
+        let ch = match char::from_u32(c) {
+            Some(ch) => ch,
+            None => continue,
+        };
+        let expected = if is_punctuation(ch) {
+            Flanking::Punctuation
+        } else if ch.is_whitespace() {
+            Flanking::Whitespace
+        } else {
+            Flanking::Other
+        };
+        assert!(flanking(ch) == expected, "U+{:04X}", c);
+    }
+
+    assert!(is_punctuation('!') && is_punctuation('\u{2e5d}') && is_punctuation('\u{1e95f}'));
+    assert!(!is_punctuation('$') && !is_punctuation('a') && !is_punctuation('\u{1e960}'));
+}
+
 #[test]
 fn nested_tables_1() {
     html_opts!(
@@ -952,6 +1573,40 @@ fn no_stack_smash_cm() {
     cm::format_document(root, &ComrakOptions::default(), &mut output).unwrap()
 }
 
+#[test]
+fn deep_nesting_on_small_stack() {
+    // Renderers are commonly run on worker threads with small stacks, so no
+    // stage may recurse on the depth of the document.
+    let worker = ::std::thread::Builder::new()
+        .stack_size(256 * 1024)
+        .spawn(|| {
+            let depth = 100_000;
+            let inputs = vec![
+                ">".repeat(depth),
+                "- ".repeat(depth) + "a\n",
+                "*a ".repeat(depth) + &"a*".repeat(depth),
+                "[".repeat(depth) + "a" + &"](/u)".repeat(depth),
+                "# ".to_string() + &"**".repeat(depth) + "a" + &"**".repeat(depth),
+                "[^a]\n\n[^a]: ".to_string() + &"> ".repeat(depth) + "a\n",
+            ];
+
+            let mut options = ComrakOptions::default();
+            options.extension.footnotes = true;
+            options.extension.header_ids = Some("".to_string());
+
+            for input in &inputs {
+                let arena = Arena::new();
+                let root = parse_document(&arena, input, &options);
+                let mut output = vec![];
+                html::format_document(root, &options, &mut output).unwrap();
+                let mut output = vec![];
+                cm::format_document(root, &options, &mut output).unwrap();
+            }
+        })
+        .unwrap();
+    worker.join().unwrap();
+}
+
 #[test]
 fn cm_autolink_regression() {
     // Testing that the cm renderer handles this case without crashing
@@ -1101,6 +1756,10 @@ fn exercise_full_api() {
 
     let _: &AstNode = ::parse_document(&arena, "document", &default_options);
 
+    let defs: ::ReferenceDefinitions = ::ReferenceDefinitions::parse("[a]: b", &default_options);
+    let _: usize = defs.len();
+    let _: bool = defs.is_empty();
+
     let _: &AstNode = ::parse_document_with_broken_link_callback(
         &arena,
         "document",
@@ -1124,6 +1783,7 @@ fn exercise_full_api() {
         parse: ::ComrakParseOptions {
             smart: false,
             default_info_string: Some("abc".to_string()),
+            reference_definitions: Some(::std::sync::Arc::new(defs)),
         },
         render: ::ComrakRenderOptions {
             hardbreaks: false,
@@ -1221,3 +1881,227 @@ fn exercise_full_api() {
         }
     }
 }
+
+#[test]
+fn url_scheme_filter() {
+    html(
+        concat!(
+            "[a](JavaScript:x) [b](vbscript:x) [c](FILE:///etc) [d](java+script:x)\n",
+            "![e](data:image/webp;base64,AA) ![f](DATA:IMAGE/JPEG,x) ![g](data:image/svg+xml,x)\n",
+        ),
+        concat!(
+            "<p><a href=\"\">a</a> <a href=\"\">b</a> <a href=\"\">c</a> ",
+            "<a href=\"java+script:x\">d</a>\n",
+            "<img src=\"data:image/webp;base64,AA\" alt=\"e\" /> ",
+            "<img src=\"DATA:IMAGE/JPEG,x\" alt=\"f\" /> <img src=\"\" alt=\"g\" /></p>\n",
+        ),
+    );
+
+    let mut filter = ::UrlSchemeFilter::new();
+    filter.deny(&["FTP"]);
+    assert!(filter.is_dangerous(b"ftp://example.com"));
+    assert!(filter.is_dangerous(b"javascript:x"));
+    assert!(!filter.is_dangerous(b"https://example.com"));
+    assert!(!filter.is_dangerous(b"../ftp:x"));
+
+    filter.allow_only(&["https", "javascript", "data"]);
+    assert!(filter.is_dangerous(b"http://example.com"));
+    assert!(filter.is_dangerous(b"javascript:x"));
+    assert!(filter.is_dangerous(b"data:text/html,x"));
+    assert!(!filter.is_dangerous(b"HTTPS://example.com"));
+    assert!(!filter.is_dangerous(b"data:image/gif,x"));
+    assert!(!filter.is_dangerous(b"/relative:path"));
+
+    let sanitizer = ::HtmlSanitizer::new();
+    let mut plugins = ::ComrakPlugins::default();
+    plugins.render.html_sanitizer = Some(&sanitizer);
+    plugins.render.url_scheme_filter = Some(&filter);
+    let mut options = ComrakOptions::default();
+    options.render.unsafe_ = true;
+    assert_eq!(
+        ::markdown_to_html_with_plugins(
+            concat!(
+                "[a](gopher://x) <a href=\"h&#116;tp://x\">b</a> ",
+                "<a href=\"averyveryverylongschemename-that-goes-on:x\">c</a> ",
+                "<a href=\"https://x\">d</a>\n",
+            ),
+            &ComrakOptions::default(),
+            &plugins
+        ),
+        "<p><a href=\"\">a</a> <a>b</a> <a>c</a> <a href=\"https://x\">d</a></p>\n",
+    );
+    assert_eq!(
+        ::markdown_to_html_with_plugins("[a](gopher://x)\n", &options, &plugins),
+        "<p><a href=\"gopher://x\">a</a></p>\n",
+    );
+}
+
+#[cfg(feature = "tokio")]
+#[test]
+fn format_async() {
+    use std::future::Future;
+    use std::io;
+    use std::pin::Pin;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Arc;
+    use std::task::{Context, Poll, Wake, Waker};
+    use tokio::io::AsyncWrite;
+
+    let mut options = ComrakOptions::default();
+    options.extension.header_ids = Some("".to_string());
+    options.extension.footnotes = true;
+    options.render.width = 30;
+
+    // Long enough to take many chunks, with a list that spans several.
+    let mut md = String::new();
+    for i in 0..200 {
+        md.push_str(&format!(
+            "# Section\n\nSee note[^{}], then read *on* through a paragraph that wraps.\n\n",
+            i
+        ));
+    }
+    for i in 0..2000 {
+        md.push_str(&format!(
+            "- item {} with [a link](http://example.com/{})\n",
+            i, i
+        ));
+    }
+    for i in 0..200 {
+        md.push_str(&format!("\n[^{}]: Note {}.\n", i, i));
+    }
+
+    let arena = Arena::new();
+    let root = parse_document(&arena, &md, &options);
+    let mut expected = vec![];
+    html::format_document(root, &options, &mut expected).unwrap();
+    cm::format_document(root, &options, &mut expected).unwrap();
+
+    struct Wakes(AtomicUsize);
+    impl Wake for Wakes {
+        fn wake(self: Arc<Self>) {
+            self.0.fetch_add(1, Ordering::SeqCst);
+        }
+    }
+    let wakes = Arc::new(Wakes(AtomicUsize::new(0)));
+    let waker = Waker::from(wakes.clone());
+    let mut cx = Context::from_waker(&waker);
+
+    // An output that's only ready every other time, and then takes just a few
+    // bytes, has the formatter wait on it.
+    struct Trickle {
+        output: Vec<u8>,
+        ready: bool,
+    }
+    impl AsyncWrite for Trickle {
+        fn poll_write(
+            mut self: Pin<&mut Self>,
+            cx: &mut Context,
+            buf: &[u8],
+        ) -> Poll<io::Result<usize>> {
+            self.ready = !self.ready;
+            if !self.ready {
+                cx.waker().wake_by_ref();
+                return Poll::Pending;
+            }
+            let len = buf.len().min(7);
+            self.output.extend_from_slice(&buf[..len]);
+            Poll::Ready(Ok(len))
+        }
+        fn poll_flush(self: Pin<&mut Self>, _: &mut Context) -> Poll<io::Result<()>> {
+            Poll::Ready(Ok(()))
+        }
+        fn poll_shutdown(self: Pin<&mut Self>, _: &mut Context) -> Poll<io::Result<()>> {
+            Poll::Ready(Ok(()))
+        }
+    }
+    let mut trickle = Trickle {
+        output: vec![],
+        ready: false,
+    };
+    {
+        let mut future = ::format_html_async(root, &options, &mut trickle);
+        while let Poll::Pending = Pin::new(&mut future).poll(&mut cx) {}
+    }
+    {
+        let mut future = ::format_commonmark_async(root, &options, &mut trickle);
+        while let Poll::Pending = Pin::new(&mut future).poll(&mut cx) {}
+    }
+    assert!(trickle.output == expected);
+
+    // Even when the output never waits, the future yields between chunks.
+    wakes.0.store(0, Ordering::SeqCst);
+    let mut output = vec![];
+    let mut future = ::format_html_async(root, &options, &mut output);
+    let mut polls = 1;
+    while Pin::new(&mut future).poll(&mut cx).is_pending() {
+        polls += 1;
+    }
+    assert!(polls > 10);
+    assert_eq!(wakes.0.load(Ordering::SeqCst), polls - 1);
+    assert!(output == &expected[..output.len()]);
+}
+
+#[test]
+fn format_json() {
+    let mut options = ComrakOptions::default();
+    options.extension.table = true;
+    options.extension.tasklist = true;
+    options.extension.footnotes = true;
+
+    let arena = Arena::new();
+    let root = parse_document(
+        &arena,
+        concat!(
+            "## \"Quo\\\\te\"\n",
+            "\n",
+            "- [x] a [link](/u \"t\")[^1]\n",
+            "\n",
+            "|a|\n",
+            "|:-|\n",
+            "\n",
+            "```rust\n",
+            "\ttab\n",
+            "```\n",
+            "\n",
+            "[^1]: `c`\n",
+        ),
+        &options,
+    );
+    // Payloads needn't be valid UTF-8 once the AST has been changed.
+    if let Some(text) = root
+        .descendants()
+        .find(|n| n.data.borrow().value.text() == Some(&b"a ".to_vec()))
+    {
+        text.data.borrow_mut().value = NodeValue::Text(b"a\xff\x01 ".to_vec());
+    }
+
+    let mut json = vec![];
+    ::format_json(root, &options, &mut json).unwrap();
+    assert_eq!(
+        String::from_utf8(json).unwrap(),
+        concat!(
+            r#"{"type":"document","start_line":0,"children":["#,
+            r#"{"type":"heading","start_line":1,"level":2,"setext":false,"children":["#,
+            r#"{"type":"text","literal":"\"Quo\\te\"","children":[]}]},"#,
+            r#"{"type":"list","start_line":3,"list_type":"bullet","start":1,"delimiter":"period","bullet_char":"-","tight":true,"children":["#,
+            r#"{"type":"item","start_line":3,"list_type":"bullet","start":1,"delimiter":"period","bullet_char":"-","tight":false,"children":["#,
+            r#"{"type":"paragraph","start_line":3,"children":["#,
+            r#"{"type":"task_item","checked":true,"children":[]},"#,
+            r#"{"type":"text","literal":"a"#,
+            "\u{fffd}",
+            r#"\u0001 ","children":[]},"#,
+            r#"{"type":"link","url":"/u","title":"t","children":["#,
+            r#"{"type":"text","literal":"link","children":[]}]},"#,
+            r#"{"type":"footnote_reference","name":"1","children":[]}]}]}]},"#,
+            r#"{"type":"table","start_line":6,"alignments":["left"],"children":["#,
+            r#"{"type":"table_row","start_line":6,"header":true,"children":["#,
+            r#"{"type":"table_cell","start_line":6,"children":["#,
+            r#"{"type":"text","literal":"a","children":[]}]}]}]},"#,
+            r#"{"type":"code_block","start_line":8,"fenced":true,"fence_char":"`","fence_length":3,"info":"rust","literal":"\ttab\n","children":[]},"#,
+            r#"{"type":"footnote_definition","start_line":12,"name":"1","children":["#,
+            r#"{"type":"paragraph","start_line":12,"children":["#,
+            r#"{"type":"code","num_backticks":1,"literal":"c","children":[]}]}]}]}"#,
+            "\n",
+        ),
+    );
+}
@@ -0,0 +1,545 @@
+//! Watch mode for the `comrak` binary: renders every Markdown file under a directory, then
+//! re-renders each one whenever it changes, as reported by Linux's inotify.
+
+use comrak::{Arena, ComrakOptions};
+use libc::{self, c_int};
+use std::collections::{BTreeSet, HashMap};
+use std::env;
+use std::ffi::{CString, OsStr, OsString};
+use std::fs;
+use std::io::{self, BufWriter, Read};
+use std::mem;
+use std::os::unix::ffi::OsStrExt;
+use std::path::{Component, Path, PathBuf};
+use std::ptr;
+use std::str;
+
+use {Formatter, Output};
+
+const WATCH_MASK: u32 = libc::IN_CLOSE_WRITE
+    | libc::IN_MOVED_TO
+    | libc::IN_MOVED_FROM
+    | libc::IN_CREATE
+    | libc::IN_DELETE
+    | libc::IN_ONLYDIR;
+
+/// Renders files with the same options and formatter each time, reusing its input buffer.
+pub struct Renderer<'o> {
+    options: &'o ComrakOptions,
+    formatter: Formatter,
+    extension: OsString,
+    compression: Option<&'o str>,
+    input: Vec<u8>,
+}
+
+impl<'o> Renderer<'o> {
+    /// A renderer writing files with the given extension, plus a suffix for `compression`.
+    pub fn new(
+        options: &'o ComrakOptions,
+        formatter: Formatter,
+        extension: &str,
+        compression: Option<&'o str>,
+    ) -> Self {
+        let mut ext = OsString::from(extension);
+        ext.push(Output::suffix(compression));
+        Renderer {
+            options,
+            formatter,
+            extension: ext,
+            compression,
+            input: Vec::with_capacity(2048),
+        }
+    }
+
+    fn render(&mut self, path: &Path, out_path: &Path) -> io::Result<()> {
+        self.input.clear();
+        fs::File::open(path)?.read_to_end(&mut self.input)?;
+        let input = str::from_utf8(&self.input)
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        if let Some(parent) = out_path.parent() {
+            fs::create_dir_all(parent)?;
+        }
+        let file = BufWriter::new(fs::File::create(out_path)?);
+        let mut output = Output::new(Box::new(file), self.compression)?;
+        let arena = Arena::new();
+        let root = comrak::parse_document(&arena, input, self.options);
+        (self.formatter)(root, self.options, &mut output)?;
+        output.finish()
+    }
+}
+
+/// Renders the Markdown files under `dir` into the same places under `out_dir`, then watches
+/// `dir`, re-rendering each file when it's written, and removing its output when it's removed or
+/// moved away.  `out_dir` may be inside `dir`, but not `dir` itself or above it.  Only returns if
+/// watching fails.
+pub fn watch(dir: &Path, out_dir: &Path, renderer: &mut Renderer) -> io::Result<()> {
+    let mut tree = Tree::new(dir, out_dir)?;
+
+    // Watch before rendering, so that nothing changed meanwhile is missed.
+    let mut changed = BTreeSet::new();
+    tree.add(dir, &mut changed)?;
+    tree.render(renderer, changed);
+    eprintln!("watching {} for changes", dir.display());
+
+    // Large enough for a good many events; an event never has more than
+    // NAME_MAX + 1 bytes of name.
+    let mut buffer = vec![0u8; 64 * 1024];
+    loop {
+        let len = tree.inotify.read(&mut buffer)?;
+        let changes = tree.read_events(&buffer[..len])?;
+        tree.apply(renderer, changes);
+    }
+}
+
+// What a batch of events changed.
+#[derive(Default)]
+struct Changes {
+    // Markdown files to render.
+    changed: BTreeSet<PathBuf>,
+    // Markdown files whose output is to be removed.
+    removed: BTreeSet<PathBuf>,
+    // Directories whose output directory is to be removed.
+    removed_dirs: Vec<PathBuf>,
+    // Whether events were lost and the tree rescanned, so that `changed`
+    // holds every Markdown file in it, and any other output is stale.
+    rescanned: bool,
+}
+
+struct Tree {
+    inotify: Inotify,
+    dir: PathBuf,
+    out_dir: PathBuf,
+    // The directory each watch descriptor is for.
+    watches: HashMap<c_int, PathBuf>,
+}
+
+impl Tree {
+    fn new(dir: &Path, out_dir: &Path) -> io::Result<Self> {
+        let canonical_dir = fs::canonicalize(dir)?;
+        let out_dir = resolve(out_dir)?;
+        // Rendering would otherwise write over the Markdown being watched, or
+        // the output directory would be skipped along with everything in it.
+        // Checked before anything is created, so that a bad invocation leaves
+        // nothing behind.
+        if canonical_dir.starts_with(&out_dir) {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                format!(
+                    "{} is, or contains, the directory being watched",
+                    out_dir.display()
+                ),
+            ));
+        }
+        fs::create_dir_all(&out_dir)?;
+        Ok(Tree {
+            inotify: Inotify::new()?,
+            dir: dir.to_path_buf(),
+            out_dir,
+            watches: HashMap::new(),
+        })
+    }
+
+    // Watches `dir` and the directories under it, other than the output
+    // directory, adding the Markdown files in them to `files`.  A directory
+    // under `dir` that can't be watched is warned about and left out, since
+    // the rest of the tree can still be.
+    fn add(&mut self, dir: &Path, files: &mut BTreeSet<PathBuf>) -> io::Result<()> {
+        let mut stack = vec![dir.to_path_buf()];
+        while let Some(dir) = stack.pop() {
+            if fs::canonicalize(&dir).ok().as_ref() == Some(&self.out_dir) {
+                continue;
+            }
+            let wd = match self.inotify.add_watch(&dir) {
+                Ok(wd) => wd,
+                // It may have gone again since it was created.
+                Err(ref e) if e.kind() == io::ErrorKind::NotFound => continue,
+                Err(e) => {
+                    if dir == self.dir {
+                        return Err(e);
+                    }
+                    eprintln!("failed to watch {}: {}", dir.display(), e);
+                    continue;
+                }
+            };
+            if let Ok(entries) = fs::read_dir(&dir) {
+                for entry in entries.filter_map(Result::ok) {
+                    let path = entry.path();
+                    match entry.file_type() {
+                        Ok(ref t) if t.is_dir() => stack.push(path),
+                        Ok(_) if is_markdown(&path) => {
+                            files.insert(path);
+                        }
+                        _ => (),
+                    }
+                }
+            }
+            self.watches.insert(wd, dir);
+        }
+        Ok(())
+    }
+
+    // Stops watching `dir` and the directories under it.
+    fn remove(&mut self, dir: &Path) {
+        let inotify = &self.inotify;
+        self.watches.retain(|&wd, watched| {
+            if watched.starts_with(dir) {
+                inotify.rm_watch(wd);
+                false
+            } else {
+                true
+            }
+        });
+    }
+
+    // Works out what the events in `buffer` changed, watching any new
+    // directories as it goes.
+    fn read_events(&mut self, buffer: &[u8]) -> io::Result<Changes> {
+        let mut changes = Changes::default();
+        let mut offset = 0;
+        while offset < buffer.len() {
+            // The buffer is only byte-aligned, so each event is copied out.
+            let event: libc::inotify_event =
+                unsafe { ptr::read_unaligned(buffer[offset..].as_ptr() as *const _) };
+            let name_start = offset + mem::size_of::<libc::inotify_event>();
+            offset = name_start + event.len as usize;
+            let name = &buffer[name_start..offset];
+            let name = &name[..name.iter().position(|&c| c == 0).unwrap_or(name.len())];
+
+            if event.mask & libc::IN_Q_OVERFLOW != 0 {
+                self.rescan(&mut changes)?;
+                continue;
+            }
+            if event.mask & libc::IN_IGNORED != 0 {
+                self.watches.remove(&event.wd);
+                continue;
+            }
+
+            let path = match self.watches.get(&event.wd) {
+                Some(dir) => dir.join(OsStr::from_bytes(name)),
+                None => continue,
+            };
+            if event.mask & libc::IN_ISDIR != 0 {
+                if event.mask & (libc::IN_CREATE | libc::IN_MOVED_TO) != 0 {
+                    self.add(&path, &mut changes.changed)?;
+                } else if event.mask & (libc::IN_DELETE | libc::IN_MOVED_FROM) != 0 {
+                    // A moved directory's watches would otherwise carry on
+                    // under the old name.
+                    self.remove(&path);
+                    changes.removed_dirs.push(path);
+                }
+            } else if is_markdown(&path) {
+                if event.mask & (libc::IN_CLOSE_WRITE | libc::IN_MOVED_TO) != 0 {
+                    changes.removed.remove(&path);
+                    changes.changed.insert(path);
+                } else if event.mask & (libc::IN_DELETE | libc::IN_MOVED_FROM) != 0 {
+                    changes.changed.remove(&path);
+                    changes.removed.insert(path);
+                }
+            }
+        }
+        Ok(changes)
+    }
+
+    // Events were dropped, so anything might have changed: watches the tree
+    // afresh, and marks every Markdown file in it as changed.  Directories
+    // created meanwhile are watched, and those moved away or removed are not.
+    fn rescan(&mut self, changes: &mut Changes) -> io::Result<()> {
+        let old = mem::replace(&mut self.watches, HashMap::new());
+        let dir = self.dir.clone();
+        self.add(&dir, &mut changes.changed)?;
+        // A directory still in the tree keeps its descriptor.
+        for (wd, _) in old {
+            if !self.watches.contains_key(&wd) {
+                self.inotify.rm_watch(wd);
+            }
+        }
+        changes.rescanned = true;
+        Ok(())
+    }
+
+    // Removes the output of what's gone, then renders what's changed.
+    fn apply(&self, renderer: &mut Renderer, changes: Changes) {
+        if changes.rescanned {
+            self.remove_stale(renderer, &changes.changed);
+        }
+        for dir in changes.removed_dirs {
+            if let Ok(relative) = dir.strip_prefix(&self.dir) {
+                let out_path = self.out_dir.join(relative);
+                match fs::remove_dir_all(&out_path) {
+                    Ok(()) => eprintln!("removed {}", out_path.display()),
+                    Err(ref e) if e.kind() == io::ErrorKind::NotFound => (),
+                    Err(e) => eprintln!("failed to remove {}: {}", out_path.display(), e),
+                }
+            }
+        }
+        for path in changes.removed {
+            if let Some(out_path) = self.out_path(&path, renderer) {
+                match fs::remove_file(&out_path) {
+                    Ok(()) => eprintln!("removed {}", out_path.display()),
+                    Err(ref e) if e.kind() == io::ErrorKind::NotFound => (),
+                    Err(e) => eprintln!("failed to remove {}: {}", out_path.display(), e),
+                }
+            }
+        }
+        self.render(renderer, changes.changed);
+    }
+
+    // Removes what's under the output directory with nothing in the tree to
+    // render it, given every Markdown file now in the tree: directories with
+    // no directory in their place, and files with the renderer's extension
+    // that aren't the output of one of `files`.
+    fn remove_stale(&self, renderer: &Renderer, files: &BTreeSet<PathBuf>) {
+        let outputs: BTreeSet<PathBuf> = files
+            .iter()
+            .filter_map(|path| self.out_path(path, renderer))
+            .collect();
+        let mut suffix = b".".to_vec();
+        suffix.extend_from_slice(renderer.extension.as_bytes());
+
+        let mut stack = vec![self.out_dir.clone()];
+        while let Some(out_dir) = stack.pop() {
+            let entries = match fs::read_dir(&out_dir) {
+                Ok(entries) => entries,
+                Err(_) => continue,
+            };
+            for entry in entries.filter_map(Result::ok) {
+                let out_path = entry.path();
+                let source = match out_path.strip_prefix(&self.out_dir) {
+                    Ok(relative) => self.dir.join(relative),
+                    Err(_) => continue,
+                };
+                let removed = match entry.file_type() {
+                    Ok(ref t) if t.is_dir() => {
+                        if source.is_dir() {
+                            stack.push(out_path);
+                            continue;
+                        }
+                        fs::remove_dir_all(&out_path)
+                    }
+                    Ok(_) => {
+                        if outputs.contains(&out_path)
+                            || !out_path.as_os_str().as_bytes().ends_with(&suffix)
+                        {
+                            continue;
+                        }
+                        fs::remove_file(&out_path)
+                    }
+                    Err(_) => continue,
+                };
+                match removed {
+                    Ok(()) => eprintln!("removed {}", out_path.display()),
+                    Err(ref e) if e.kind() == io::ErrorKind::NotFound => (),
+                    Err(e) => eprintln!("failed to remove {}: {}", out_path.display(), e),
+                }
+            }
+        }
+    }
+
+    fn out_path(&self, path: &Path, renderer: &Renderer) -> Option<PathBuf> {
+        let relative = path.strip_prefix(&self.dir).ok()?;
+        Some(
+            self.out_dir
+                .join(relative)
+                .with_extension(&renderer.extension),
+        )
+    }
+
+    fn render(&self, renderer: &mut Renderer, paths: BTreeSet<PathBuf>) {
+        for path in paths {
+            if let Some(out_path) = self.out_path(&path, renderer) {
+                match renderer.render(&path, &out_path) {
+                    Ok(()) => eprintln!("rendered {}", out_path.display()),
+                    // It may have gone again since it changed.
+                    Err(ref e) if e.kind() == io::ErrorKind::NotFound => (),
+                    Err(e) => eprintln!("failed to render {}: {}", path.display(), e),
+                }
+            }
+        }
+    }
+}
+
+// Where `path` is, or would be once created: the canonical path of its
+// nearest existing ancestor, followed by the rest.  What doesn't exist yet
+// can't be a symlink, so `..` in the rest is resolved by dropping the
+// component before it.
+fn resolve(path: &Path) -> io::Result<PathBuf> {
+    let path = env::current_dir()?.join(path);
+    for ancestor in path.ancestors() {
+        let mut resolved = match fs::canonicalize(ancestor) {
+            Ok(resolved) => resolved,
+            Err(ref e) if e.kind() == io::ErrorKind::NotFound => continue,
+            Err(e) => return Err(e),
+        };
+        for component in path.strip_prefix(ancestor).unwrap().components() {
+            match component {
+                Component::ParentDir => {
+                    resolved.pop();
+                }
+                Component::Normal(name) => resolved.push(name),
+                _ => (),
+            }
+        }
+        return Ok(resolved);
+    }
+    Err(io::Error::new(
+        io::ErrorKind::NotFound,
+        format!("{} doesn't exist", path.display()),
+    ))
+}
+
+fn is_markdown(path: &Path) -> bool {
+    match path.extension().and_then(OsStr::to_str) {
+        Some(ext) => ext.eq_ignore_ascii_case("md") || ext.eq_ignore_ascii_case("markdown"),
+        None => false,
+    }
+}
+
+struct Inotify(c_int);
+
+impl Inotify {
+    fn new() -> io::Result<Self> {
+        let fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Inotify(fd))
+    }
+
+    fn add_watch(&self, dir: &Path) -> io::Result<c_int> {
+        let dir = CString::new(dir.as_os_str().as_bytes())?;
+        let wd = unsafe { libc::inotify_add_watch(self.0, dir.as_ptr(), WATCH_MASK) };
+        if wd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(wd)
+    }
+
+    fn rm_watch(&self, wd: c_int) {
+        unsafe {
+            libc::inotify_rm_watch(self.0, wd);
+        }
+    }
+
+    fn read(&self, buffer: &mut [u8]) -> io::Result<usize> {
+        loop {
+            let len = unsafe {
+                libc::read(
+                    self.0,
+                    buffer.as_mut_ptr() as *mut libc::c_void,
+                    buffer.len(),
+                )
+            };
+            if len >= 0 {
+                return Ok(len as usize);
+            }
+            let e = io::Error::last_os_error();
+            if e.kind() != io::ErrorKind::Interrupted {
+                return Err(e);
+            }
+        }
+    }
+}
+
+impl Drop for Inotify {
+    fn drop(&mut self) {
+        unsafe {
+            libc::close(self.0);
+        }
+    }
+}
+
+#[test]
+fn tree_tracks_changes() {
+    use std::env;
+    use std::process;
+
+    let root = env::temp_dir().join(format!("comrak-watch-{}", process::id()));
+    let dir = root.join("docs");
+    let out_dir = root.join("out");
+    fs::create_dir_all(dir.join("sub")).unwrap();
+    fs::write(dir.join("a.md"), "# A\n").unwrap();
+    fs::write(dir.join("notes.txt"), "x\n").unwrap();
+    fs::write(dir.join("sub/b.markdown"), "*b*\n").unwrap();
+
+    assert!(Tree::new(&dir, &dir).is_err());
+    assert!(Tree::new(&dir, &root).is_err());
+    assert!(Tree::new(&dir, &dir.join("new/../..")).is_err());
+    assert!(!dir.join("new").exists());
+
+    let options = ComrakOptions::default();
+    let mut renderer = Renderer::new(&options, comrak::format_html, "html", None);
+    let mut tree = Tree::new(&dir, &out_dir).unwrap();
+    let mut files = BTreeSet::new();
+    tree.add(&dir, &mut files).unwrap();
+    assert_eq!(tree.watches.len(), 2);
+    assert_eq!(
+        files.iter().collect::<Vec<_>>(),
+        vec![&dir.join("a.md"), &dir.join("sub/b.markdown")]
+    );
+    let out_dir = fs::canonicalize(&out_dir).unwrap();
+    assert_eq!(
+        tree.out_path(&dir.join("sub/b.markdown"), &renderer),
+        Some(out_dir.join("sub/b.html"))
+    );
+
+    tree.render(&mut renderer, files);
+    assert_eq!(
+        fs::read_to_string(out_dir.join("a.html")).unwrap(),
+        "<h1>A</h1>\n"
+    );
+    assert!(out_dir.join("sub/b.html").exists());
+
+    fs::write(dir.join("a.md"), "# A2\n").unwrap();
+    fs::remove_file(dir.join("sub/b.markdown")).unwrap();
+    fs::remove_dir(dir.join("sub")).unwrap();
+    fs::create_dir(dir.join("new")).unwrap();
+    fs::write(dir.join("new/c.md"), "c\n").unwrap();
+
+    let mut buffer = vec![0u8; 64 * 1024];
+    let len = tree.inotify.read(&mut buffer).unwrap();
+    let changes = tree.read_events(&buffer[..len]).unwrap();
+    assert_eq!(
+        changes.changed.iter().collect::<Vec<_>>(),
+        vec![&dir.join("a.md"), &dir.join("new/c.md")]
+    );
+    assert_eq!(
+        changes.removed.iter().collect::<Vec<_>>(),
+        vec![&dir.join("sub/b.markdown")]
+    );
+    assert_eq!(changes.removed_dirs, vec![dir.join("sub")]);
+
+    tree.apply(&mut renderer, changes);
+    assert_eq!(
+        fs::read_to_string(out_dir.join("a.html")).unwrap(),
+        "<h1>A2</h1>\n"
+    );
+    assert!(!out_dir.join("sub").exists());
+    assert!(out_dir.join("new/c.html").exists());
+
+    // As if the events for these had been dropped.
+    fs::remove_file(dir.join("new/c.md")).unwrap();
+    fs::rename(dir.join("new"), root.join("moved")).unwrap();
+    fs::create_dir(dir.join("late")).unwrap();
+    fs::write(dir.join("late/d.md"), "d\n").unwrap();
+    fs::write(out_dir.join("gone.html"), "x\n").unwrap();
+    fs::write(out_dir.join("keep.txt"), "x\n").unwrap();
+    let mut changes = Changes::default();
+    tree.rescan(&mut changes).unwrap();
+    assert_eq!(
+        changes.changed.iter().collect::<Vec<_>>(),
+        vec![&dir.join("a.md"), &dir.join("late/d.md")]
+    );
+    let mut watched = tree.watches.values().collect::<Vec<_>>();
+    watched.sort();
+    assert_eq!(watched, vec![&dir, &dir.join("late")]);
+
+    tree.apply(&mut renderer, changes);
+    assert!(out_dir.join("a.html").exists());
+    assert!(!out_dir.join("new").exists());
+    assert!(out_dir.join("late/d.html").exists());
+    assert!(!out_dir.join("gone.html").exists());
+    assert!(out_dir.join("keep.txt").exists());
+
+    fs::remove_dir_all(&root).unwrap();
+}